@@ -1,17 +1,44 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <setjmp.h>
 
 typedef struct Node Node;
 
+//
+// main.c
+//
+extern int opt_inline_limit;
+extern bool opt_info;
+extern bool opt_avx2;
+extern int opt_max_errors;
+extern char **include_paths;
+extern bool opt_profile_generate;
+extern char *opt_profile_use;
+extern bool opt_instrument_functions;
+extern int opt_level;
+extern bool opt_time_report;
+
 //
 // util.c
 //
 char *read_file(char *path);
+void *arena_alloc(size_t size);
+
+// Position in the node arena, to free everything allocated after it.
+typedef struct
+{
+  void *chunk;
+  size_t used;
+} ArenaMark;
+
+ArenaMark arena_mark(void);
+void arena_release(ArenaMark mark);
 
 //
 // tokenize.c
@@ -29,16 +56,33 @@ typedef enum
   TK_EOF       // End-of-file markers
 } TokenKind;
 
+// Source file
+typedef struct File File;
+struct File
+{
+  char *name;
+  char *contents;
+  char **line_starts; // Start of every line, for error messages
+  int line_count;
+};
+
+typedef struct Hideset Hideset;
+typedef struct Lexer Lexer;
+
 // Token type
 typedef struct Token Token;
 struct Token
 {
-  TokenKind kind; // Token kind
-  Token *next;    // Next token
-  int val;        // If kind is TK_NUM, its value
-  char *loc;      // Token location
-  char *str;      // Token string
-  size_t len;     // Token length
+  TokenKind kind;   // Token kind
+  Token *next;      // Next token
+  int val;          // If kind is TK_NUM, its value
+  char *loc;        // Token location
+  char *str;        // Token string
+  size_t len;       // Token length
+  File *file;       // Source file of `loc`
+  bool at_bol;      // First token on its line
+  bool has_space;   // Preceded by whitespace
+  Hideset *hideset; // Macros not to expand again, for the preprocessor
 };
 
 typedef enum
@@ -68,6 +112,13 @@ struct Obj
   Type *ty;      // Type
   bool is_local; // local or global/function/str
 
+  // Local variable
+  bool addr_taken; // Address may escape; set by frame layout
+  int live_begin;  // First use in AST walk order; set by frame layout
+  int live_end;    // Last use in AST walk order; set by frame layout
+  int weight;      // Uses, weighted by loop nesting; set by frame layout
+  int reg;         // 1 + index into var_regs64 etc., or 0 if on the stack
+
   // Global variable or function
   bool is_function;
   char *init_data;
@@ -79,11 +130,19 @@ struct Obj
   Obj **locals;
   int stack_size;
   int regards_num;
+  int nsites; // Branch sites numbered by the parser, for profiles
+  bool is_leaf;   // Makes no calls; set by frame layout
+  int saved_regs; // Bitmask of the callee-saved `reg`s used
 };
 
+extern int error_count;
+extern jmp_buf *error_recover;
+
 void error(char *fmt, ...);
 void error_at(char *loc, char *msg);
 void error_tok(Token **tok, char *fmt, ...);
+Token *token_stream(Token *(*source)(void));
+void next_token(Token **tok);
 bool consume(Token **tok, char *op);
 bool equal(Token **tok, char *op);
 bool equal_xnext(Token **tok, char *op, int x);
@@ -91,9 +150,17 @@ bool expect_ident(Token **tok);
 void expect(Token **tok, char *op);
 int expect_number(Token **tok);
 bool at_eof(Token **tok);
+bool is_hash(Token *tok);
+Lexer *new_lexer(char *path, char *p);
+Token *lex(Lexer *lx);
 Token *tokenize(char *filename, char *p);
 char *mystrndup(const char *s, size_t n);
 
+//
+// preprocess.c
+//
+Token *preprocess(Lexer *lx);
+
 //
 // parse.c
 //
@@ -118,57 +185,186 @@ typedef enum
   ND_ELSE,    // else
   ND_WHILE,   // while
   ND_FOR,     // for
+  ND_SWITCH,  // switch
+  ND_CASE,    // case or default label
+  ND_BREAK,   // break
   ND_SIZEOF,  // sizeof
   ND_BLOCK,   // { ... }
   ND_FUNCALL, // function call
   ND_ADDR,    // &address
   ND_DEREF,   // *pointer
+  ND_INLINE,  // inlined function call
+  ND_VECLOOP, // vectorized part of a counted loop
   ND_NONE     // None
 } NodeKind;
 
+typedef enum
+{
+  VEC_COPY, // dst[i] = src1[i]
+  VEC_ADD,  // dst[i] = src1[i] + src2[i]
+  VEC_SUB,  // dst[i] = src1[i] - src2[i]
+  VEC_SUM,  // acc = acc + src1[i]
+} VecOp;
+
+// A counted loop `for (...; i < end; i = i + 1)` over arrays, run several
+// elements at a time from the current value of `index` while at least one
+// full vector remains. The original loop follows and finishes the rest.
+typedef struct VecLoop VecLoop;
+struct VecLoop
+{
+  VecOp op;
+  int elem_size;  // 1 (char) or 4 (int)
+  Obj *index;     // Induction variable
+  Node *end;      // Loop bound
+  bool inclusive; // `i <= end` rather than `i < end`
+  Node *dst;      // Base address of the destination (not VEC_SUM)
+  Node *src1;     // Base address of the first source
+  Node *src2;     // Base address of the second source (VEC_ADD, VEC_SUB)
+  Obj *acc;       // Accumulator (VEC_SUM)
+};
+
 // AST node type
+//
+// Every node starts with the common header (kind, ty, next) and carries only
+// the union member its kind uses. new_node() allocates just that much from the
+// node arena, so a node's kind may only be changed in place to another kind
+// that uses the same member.
 struct Node
 {
   NodeKind kind; // Node kind
-  Node *next;    // Next node
   Type *ty;      // Type, e.g. int or pointer to int.
+  Node *next;    // Next node (function arguments)
 
-  Node *lhs; // Left-hand side
-  Node *rhs; // Right-hand side
+  union
+  {
+    // Unary and binary operators, ND_ASSIGN, ND_RETURN, ND_SIZEOF
+    struct
+    {
+      Node *lhs; // Left-hand side
+      Node *rhs; // Right-hand side
+    };
 
-  bool eof; // EOF of Node.
+    // ND_IF, ND_IFELSE, ND_WHILE, ND_FOR, ND_SWITCH, ND_CASE
+    //
+    // A switch has its controlling expression in `cond` and its body in
+    // `then`. A case label has its value as an ND_NUM in `cond`, or NULL
+    // for `default`, and the statement it labels in `then`.
+    struct
+    {
+      Node *cond; // Conditional expressions
+      Node *then; // Run Statement by conditional expressions
+      Node *els;  // else statement
+      Node *init; // For initialization
+      Node *inc;  // For increment
+      int site;   // Profile counter site; 0 if added by an optimization
+      int label;  // ND_CASE: label number, set by codegen
+    };
 
-  Node *cond; // Conditional expressions
-  Node *then; // Run Statement by conditional expressions
-  Node *els;  // else statement
-  Node *init; // For initialization
-  Node *inc;  // For increment
+    // ND_BLOCK, ND_INLINE
+    struct
+    {
+      Node **block;    // Block statements
+      int block_count; // Block count
+      Obj *callee;     // ND_INLINE: function whose body was inlined
+    };
 
-  int val; // Used if kind == ND_NUM
+    // ND_FUNCALL
+    struct
+    {
+      char *funcname; // Function name
+      Node *args;     // Fucntion parameter value
+    };
 
-  Node **block;      // Block
-  size_t block_size; // Block size
-  int block_count;   // Block count
+    Obj *var;     // Use if kind == ND_VAR
+    int val;      // Used if kind == ND_NUM
+    VecLoop *vec; // Use if kind == ND_VECLOOP
+  };
+};
 
-  char *lvar_name; // Variable name
+Obj *parse(Token **tok, Obj *known, void (*finish_fn)(Obj *fn));
+size_t node_size(NodeKind kind);
+Node *new_node(NodeKind kind);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs);
+Node *new_unary(NodeKind kind, Node *lhs);
+Node *new_num(int val);
+Node *new_var_node(Obj *var);
+Node *copy_node(Node *node);
+Obj *new_temp_lvar(Obj *fn, Type *ty);
+char *new_unique_name(void);
 
-  char *funcname;    // Function name
-  Node *args;        // Fucntion parameter value
-  int parameter_num; // Number of Fucntion parameters
+//
+// astfile.c
+//
+void emit_ast(Obj *prog, char *path);
+Obj *load_ast(char *path);
 
-  Obj *var; // Use if kind == ND_VAR
+//
+// inline.c
+//
+int inline_functions(Obj *prog);
 
-  char *str; // Use if kind == ND_STR
-};
+//
+// sccp.c
+//
+int propagate_constants(Obj *prog);
+
+//
+// licm.c
+//
+int hoist_loop_invariants(Obj *prog);
+
+//
+// vectorize.c
+//
+int vectorize_loops(Obj *prog);
+
+//
+// cse.c
+//
+int eliminate_common_subexprs(Obj *prog);
+
+//
+// pass.c
+//
+bool set_pass_enabled(char *name, bool on);
+bool set_print_after(char *name);
+void run_passes(Obj *prog, bool whole_program);
+void report_passes(void);
+void print_ast(Obj *prog, FILE *out);
 
-Obj *parse(Token **tok);
+//
+// profile.c
+//
+void load_profile(char *path);
+long profile_calls(Obj *fn);
+bool profile_hot(Obj *fn);
+bool profile_branch(Obj *fn, int site, long *taken, long *not_taken);
+void emit_profile_counters(Obj *prog);
 
 //
 // codegen.c
 //
 void codegen(Obj *prog);
+void codegen_function(Obj *fn);
+void codegen_finish(Obj *prog);
+
+//
+// frame.c
+//
+extern char *var_regs64[];
+extern char *var_regs32[];
+extern char *var_regs8[];
+
+void analyze_lvars(Obj *fn);
+int saved_reg_offset(Obj *fn, int reg);
+void assign_lvar_offsets(Obj *prog);
 
 //
 // type.c
 //
-void add_type(Node *node);
\ No newline at end of file
+extern Type *ty_int;
+
+void add_type(Node *node);
+Type *new_type(TypeKeyword tkey, int size, Type *ptr_to);
+Type *pointer_to(Type *base);
+Type *array_of(Type *base, int len);
\ No newline at end of file
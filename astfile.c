@@ -0,0 +1,355 @@
+#include "9cc.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary AST files.
+//
+// --emit-ast writes the program returned by parse() as one image: every
+// Obj, Type, Node, VecLoop, child array and string it reaches is copied
+// into the image and shared objects are written once. Pointers in the
+// image are offsets from its start, and a relocation table lists where
+// they are. --load-ast maps the file privately and adds the mapping's
+// address to each listed slot; nothing else is rebuilt.
+
+#define AST_MAGIC "9CCAST"
+#define AST_VERSION 3
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  // Struct sizes of the writer; the image is only valid for the same layout.
+  uint16_t node_size;
+  uint16_t obj_size;
+  uint16_t type_size;
+  uint16_t vec_size;
+  uint64_t prog;   // Offset of the first Obj
+  uint64_t relocs; // Offset of the relocation table
+  uint64_t nrelocs;
+} AstHeader;
+
+static char *buf;
+static size_t buf_len;
+static size_t buf_cap;
+
+static uint64_t *relocs;
+static size_t nrelocs;
+static size_t relocs_cap;
+
+// Maps an already written object to its offset in the image.
+typedef struct
+{
+  void *ptr;
+  size_t off;
+} Written;
+
+static Written *written;
+static size_t written_cap;
+static size_t nwritten;
+
+static size_t hash_ptr(void *ptr)
+{
+  uintptr_t x = (uintptr_t)ptr;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static Written *lookup(void *ptr)
+{
+  size_t mask = written_cap - 1;
+  for (size_t i = hash_ptr(ptr) & mask;; i = (i + 1) & mask)
+    if (written[i].ptr == ptr || !written[i].ptr)
+      return &written[i];
+}
+
+static void remember(void *ptr, size_t off)
+{
+  if (nwritten * 2 >= written_cap)
+  {
+    Written *old = written;
+    size_t old_cap = written_cap;
+    written_cap = written_cap ? written_cap * 2 : 1024;
+    written = calloc(written_cap, sizeof(Written));
+    for (size_t i = 0; i < old_cap; i++)
+      if (old[i].ptr)
+        *lookup(old[i].ptr) = old[i];
+    free(old);
+  }
+  Written *w = lookup(ptr);
+  w->ptr = ptr;
+  w->off = off;
+  nwritten++;
+}
+
+// Appends `size` bytes of `data` to the image and returns their offset.
+static size_t put_bytes(void *data, size_t size)
+{
+  size_t off = (buf_len + 7) & ~(size_t)7;
+  if (off + size > buf_cap)
+  {
+    while (off + size > buf_cap)
+      buf_cap = buf_cap ? buf_cap * 2 : 64 * 1024;
+    buf = realloc(buf, buf_cap);
+  }
+  memset(buf + buf_len, 0, off - buf_len);
+  memcpy(buf + off, data, size);
+  buf_len = off + size;
+  return off;
+}
+
+// Stores offset `target` into the pointer field at `off`.
+static void set_ptr(size_t off, size_t target)
+{
+  if (!target)
+  {
+    memset(buf + off, 0, sizeof(void *));
+    return;
+  }
+
+  uint64_t val = target;
+  memcpy(buf + off, &val, sizeof(val));
+  if (nrelocs == relocs_cap)
+  {
+    relocs_cap = relocs_cap ? relocs_cap * 2 : 1024;
+    relocs = realloc(relocs, sizeof(uint64_t) * relocs_cap);
+  }
+  relocs[nrelocs++] = off;
+}
+
+// Copies `size` bytes at `ptr` into the image unless already written.
+// Sets `*fresh` if the caller must now fix up its pointer fields.
+static size_t put_object(void *ptr, size_t size, bool *fresh)
+{
+  *fresh = false;
+  if (!ptr)
+    return 0;
+  if (written_cap)
+  {
+    Written *w = lookup(ptr);
+    if (w->ptr)
+      return w->off;
+  }
+  size_t off = put_bytes(ptr, size);
+  remember(ptr, off);
+  *fresh = true;
+  return off;
+}
+
+static size_t put_string(char *s, size_t len)
+{
+  bool fresh;
+  return put_object(s, len, &fresh);
+}
+
+#define FIELD(off, type, field) ((off) + offsetof(type, field))
+
+static size_t put_obj(Obj *obj);
+static size_t put_node(Node *node);
+
+static size_t put_type(Type *ty)
+{
+  bool fresh;
+  size_t off = put_object(ty, sizeof(Type), &fresh);
+  if (fresh)
+    set_ptr(FIELD(off, Type, ptr_to), put_type(ty->ptr_to));
+  return off;
+}
+
+static size_t put_node_array(Node **nodes, int n)
+{
+  // An empty array may share its address with the next allocation.
+  if (n == 0)
+    return 0;
+
+  bool fresh;
+  size_t off = put_object(nodes, sizeof(Node *) * n, &fresh);
+  if (fresh)
+    for (int i = 0; i < n; i++)
+      set_ptr(off + sizeof(Node *) * i, put_node(nodes[i]));
+  return off;
+}
+
+static size_t put_vec(VecLoop *vec)
+{
+  bool fresh;
+  size_t off = put_object(vec, sizeof(VecLoop), &fresh);
+  if (!fresh)
+    return off;
+  set_ptr(FIELD(off, VecLoop, index), put_obj(vec->index));
+  set_ptr(FIELD(off, VecLoop, end), put_node(vec->end));
+  set_ptr(FIELD(off, VecLoop, dst), put_node(vec->dst));
+  set_ptr(FIELD(off, VecLoop, src1), put_node(vec->src1));
+  set_ptr(FIELD(off, VecLoop, src2), put_node(vec->src2));
+  set_ptr(FIELD(off, VecLoop, acc), put_obj(vec->acc));
+  return off;
+}
+
+static size_t put_node(Node *node)
+{
+  bool fresh;
+  size_t off = put_object(node, node ? node_size(node->kind) : 0, &fresh);
+  if (!fresh)
+    return off;
+
+  set_ptr(FIELD(off, Node, ty), put_type(node->ty));
+  set_ptr(FIELD(off, Node, next), put_node(node->next));
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_NONE:
+  case ND_BREAK:
+    break;
+  case ND_VAR:
+    set_ptr(FIELD(off, Node, var), put_obj(node->var));
+    break;
+  case ND_VECLOOP:
+    set_ptr(FIELD(off, Node, vec), put_vec(node->vec));
+    break;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    set_ptr(FIELD(off, Node, cond), put_node(node->cond));
+    set_ptr(FIELD(off, Node, then), put_node(node->then));
+    set_ptr(FIELD(off, Node, els), put_node(node->els));
+    set_ptr(FIELD(off, Node, init), put_node(node->init));
+    set_ptr(FIELD(off, Node, inc), put_node(node->inc));
+    break;
+  case ND_INLINE:
+    set_ptr(FIELD(off, Node, callee), put_obj(node->callee));
+    // fallthrough
+  case ND_BLOCK:
+    set_ptr(FIELD(off, Node, block), put_node_array(node->block, node->block_count));
+    break;
+  case ND_FUNCALL:
+    set_ptr(FIELD(off, Node, funcname), put_string(node->funcname, strlen(node->funcname) + 1));
+    set_ptr(FIELD(off, Node, args), put_node(node->args));
+    break;
+  default:
+    set_ptr(FIELD(off, Node, lhs), put_node(node->lhs));
+    set_ptr(FIELD(off, Node, rhs), put_node(node->rhs));
+  }
+  return off;
+}
+
+// Lists of objects can be long, so follow `next` iteratively.
+static size_t put_obj(Obj *obj)
+{
+  size_t first = 0;
+  size_t prev_next = 0;
+
+  for (; obj; obj = obj->next)
+  {
+    bool fresh;
+    size_t off = put_object(obj, sizeof(Obj), &fresh);
+    if (prev_next)
+      set_ptr(prev_next, off);
+    else
+      first = off;
+    if (!fresh)
+      return first;
+
+    if (obj->name)
+      set_ptr(FIELD(off, Obj, name), put_string(obj->name, strlen(obj->name) + 1));
+    set_ptr(FIELD(off, Obj, ty), put_type(obj->ty));
+    if (obj->init_data)
+      set_ptr(FIELD(off, Obj, init_data), put_string(obj->init_data, obj->ty->size));
+    set_ptr(FIELD(off, Obj, globals), put_obj(obj->globals));
+    set_ptr(FIELD(off, Obj, params), put_obj(obj->params));
+    if (obj->body)
+      set_ptr(FIELD(off, Obj, body), put_node_array(obj->body, obj->stmt_count));
+    if (obj->locals)
+    {
+      size_t cell = put_string((char *)obj->locals, sizeof(Obj *));
+      set_ptr(FIELD(off, Obj, locals), cell);
+      set_ptr(cell, put_obj(*obj->locals));
+    }
+    prev_next = FIELD(off, Obj, next);
+  }
+
+  if (prev_next)
+    set_ptr(prev_next, 0);
+  return first;
+}
+
+// Writes `prog` to `path`.
+void emit_ast(Obj *prog, char *path)
+{
+  AstHeader hdr = {
+      .magic = AST_MAGIC,
+      .version = AST_VERSION,
+      .node_size = sizeof(Node),
+      .obj_size = sizeof(Obj),
+      .type_size = sizeof(Type),
+      .vec_size = sizeof(VecLoop),
+  };
+  put_bytes(&hdr, sizeof(hdr));
+
+  size_t first = put_obj(prog);
+  size_t table = put_bytes(relocs, sizeof(uint64_t) * nrelocs);
+
+  AstHeader *h = (AstHeader *)buf;
+  h->prog = first;
+  h->relocs = table;
+  h->nrelocs = nrelocs;
+
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+  if (fwrite(buf, 1, buf_len, fp) != buf_len || fclose(fp))
+    error("cannot write %s: %s", path, strerror(errno));
+}
+
+// Maps the AST file `path` and returns its program.
+Obj *load_ast(char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    error("cannot stat %s: %s", path, strerror(errno));
+  if ((size_t)st.st_size < sizeof(AstHeader))
+    error("%s: not an AST file", path);
+
+  // A private mapping lets later passes modify the AST in place.
+  char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    error("cannot map %s: %s", path, strerror(errno));
+
+  AstHeader *h = (AstHeader *)base;
+  if (memcmp(h->magic, AST_MAGIC, sizeof(AST_MAGIC)))
+    error("%s: not an AST file", path);
+  if (h->version != AST_VERSION || h->node_size != sizeof(Node) || h->obj_size != sizeof(Obj) ||
+      h->type_size != sizeof(Type) || h->vec_size != sizeof(VecLoop))
+    error("%s: AST file version %u does not match this compiler (version %u)",
+          path, h->version, AST_VERSION);
+  if (h->relocs + sizeof(uint64_t) * h->nrelocs > (size_t)st.st_size)
+    error("%s: truncated AST file", path);
+
+  uint64_t *table = (uint64_t *)(base + h->relocs);
+  for (uint64_t i = 0; i < h->nrelocs; i++)
+  {
+    uintptr_t *slot = (uintptr_t *)(base + table[i]);
+    *slot += (uintptr_t)base;
+  }
+
+  // Labels of string literals are numbered per compilation, so they are
+  // renamed to stay apart from those of other files and of the parser.
+  Obj *prog = (Obj *)(base + h->prog);
+  for (Obj *var = prog; var; var = var->next)
+    if (!strncmp(var->name, ".L..", 4))
+      var->name = new_unique_name();
+  return prog;
+}
@@ -0,0 +1,16 @@
+// Repeated sums over a global int array: a load-add loop.
+int a[100000];
+
+int main()
+{
+  int i;
+  int k;
+  int s;
+  for (i = 0; i < 100000; i = i + 1)
+    a[i] = i - i / 8 * 8;
+  s = 0;
+  for (k = 0; k < 3000; k = k + 1)
+    for (i = 0; i < 100000; i = i + 1)
+      s = s + a[i];
+  return s - s / 256 * 256;
+}
@@ -0,0 +1,14 @@
+// Doubly recursive Fibonacci, like tests/fibonacci: call and return cost.
+int fib(int n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int main()
+{
+  int r;
+  r = fib(35);
+  return r - r / 256 * 256;
+}
@@ -0,0 +1,31 @@
+// Matrix multiplication: three nested loops with index arithmetic.
+int a[40000];
+int b[40000];
+int c[40000];
+
+int main()
+{
+  int i;
+  int j;
+  int k;
+  int n;
+  int s;
+  n = 200;
+  for (i = 0; i < n * n; i = i + 1)
+  {
+    a[i] = i - i / 7 * 7;
+    b[i] = i - i / 5 * 5;
+  }
+  for (i = 0; i < n; i = i + 1)
+    for (j = 0; j < n; j = j + 1)
+    {
+      s = 0;
+      for (k = 0; k < n; k = k + 1)
+        s = s + a[i * n + k] * b[k * n + j];
+      c[i * n + j] = s;
+    }
+  s = 0;
+  for (i = 0; i < n * n; i = i + 1)
+    s = s + c[i];
+  return s - s / 256 * 256;
+}
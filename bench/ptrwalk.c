@@ -0,0 +1,36 @@
+// Pointer walks: a pointer stepping through an array, and a chase through
+// a table of next indices.
+int data[50000];
+int next[50000];
+
+int sum(int *p, int *end)
+{
+  int s;
+  s = 0;
+  while (p < end)
+  {
+    s = s + *p;
+    p = p + 1;
+  }
+  return s;
+}
+
+int main()
+{
+  int i;
+  int j;
+  int s;
+  for (i = 0; i < 50000; i = i + 1)
+  {
+    data[i] = i - i / 16 * 16;
+    next[i] = (i + 7919) - (i + 7919) / 50000 * 50000;
+  }
+  s = 0;
+  for (i = 0; i < 2000; i = i + 1)
+    s = s + sum(data, data + 50000);
+  j = 0;
+  for (i = 0; i < 20000000; i = i + 1)
+    j = next[j];
+  s = s + j;
+  return s - s / 256 * 256;
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Benchmarks the code 9cc generates against gcc -O0 and gcc -O1.
+#
+#   bench/run.sh [9cc options...]
+#
+# Every bench/*.c program is built three ways and run; the exit codes must
+# agree. Cycles and instructions come from `perf stat` when it is
+# available, otherwise only the elapsed time is reported. The table is
+# also written to bench_output.txt.
+
+cd "$(dirname "$0")/.." || exit 1
+make -s 9cc || exit 1
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if perf stat -x, -e cycles,instructions true >/dev/null 2>&1; then
+  have_perf=1
+fi
+
+# Runs $1 and prints "<exit code> <cycles> <instructions> <seconds>".
+measure() {
+  local start end status cycles=- insns=-
+  start=$(date +%s%N)
+  if [ -n "$have_perf" ]; then
+    perf stat -x, -e cycles,instructions -o "$tmp/stat" "$1" >/dev/null
+    status=$?
+    cycles=$(awk -F, '$3 ~ /^cycles/ { print $1 }' "$tmp/stat")
+    insns=$(awk -F, '$3 ~ /^instructions/ { print $1 }' "$tmp/stat")
+  else
+    "$1" >/dev/null
+    status=$?
+  fi
+  end=$(date +%s%N)
+  echo "$status $cycles $insns $(awk "BEGIN { printf \"%.3f\", ($end - $start) / 1e9 }")"
+}
+
+failed=0
+{
+  printf "%-14s %-6s %14s %14s %9s %8s\n" program build cycles instructions seconds vs-O1
+  for src in bench/*.c; do
+    name=$(basename "$src" .c)
+    ./9cc "$@" "$src" >"$tmp/$name.s" && cc -o "$tmp/$name.9cc" "$tmp/$name.s" 2>/dev/null || {
+      echo "$name: 9cc build failed"
+      failed=1
+      continue
+    }
+    gcc -w -O0 -o "$tmp/$name.O0" "$src"
+    gcc -w -O1 -o "$tmp/$name.O1" "$src"
+
+    read -r want _ _ base <<<"$(measure "$tmp/$name.O1")"
+    for build in 9cc O0 O1; do
+      read -r status cycles insns secs <<<"$(measure "$tmp/$name.$build")"
+      if [ "$status" != "$want" ]; then
+        echo "$name: $build exited with $status, gcc -O1 with $want"
+        failed=1
+      fi
+      ratio=$(awk "BEGIN { printf \"%.2fx\", ($base > 0 ? $secs / $base : 0) }")
+      printf "%-14s %-6s %14s %14s %9s %8s\n" "$name" "$build" "$cycles" "$insns" "$secs" "$ratio"
+    done
+  done
+  exit $failed
+} | tee bench_output.txt
+exit "${PIPESTATUS[0]}"
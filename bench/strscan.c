@@ -0,0 +1,36 @@
+// Scans of a NUL-terminated char string: length and character counts.
+char text[65536];
+
+int length(char *s)
+{
+  int n;
+  n = 0;
+  while (s[n] != 0)
+    n = n + 1;
+  return n;
+}
+
+int count(char *s, int c)
+{
+  int i;
+  int k;
+  k = 0;
+  for (i = 0; s[i] != 0; i = i + 1)
+    if (s[i] == c)
+      k = k + 1;
+  return k;
+}
+
+int main()
+{
+  int i;
+  int r;
+  int total;
+  for (i = 0; i < 65535; i = i + 1)
+    text[i] = 97 + (i - i / 26 * 26);
+  text[65535] = 0;
+  total = 0;
+  for (r = 0; r < 1000; r = r + 1)
+    total = total + length(text) + count(text, 101);
+  return total - total / 256 * 256;
+}
@@ -3,118 +3,1201 @@
 static void gen(Node *node);
 static void gen_addr(Node *node);
 static void gen_funcall(Node *node);
+static void gen_operands(Node *node, char **lreg, char **rreg);
+static void gen_branch(Node *node, bool when, char *prefix, int c);
+static bool gen_tail_call(Node *node);
+static void gen_vecloop(Node *node);
 
 static char *regards64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char *regards32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 static char *regards8[] = {"DIL", "SIL", "DL", "CL", "R8B", "R9B"};
 
 static Obj *current_fn;
+static int inline_label = -1; // Label of the innermost ND_INLINE, or -1
+static int break_label = -1;  // `.Lend` label of the innermost loop or switch
+static Obj *prof_fn;          // Function whose branch sites are being emitted
+
+// A block moved out of line because the profile says it rarely runs. It
+// ends by jumping back to `.Lend<c>`.
+typedef struct ColdBlock ColdBlock;
+struct ColdBlock
+{
+  ColdBlock *next;
+  Node *node;
+  int c;
+  Obj *prof_fn;
+  int inline_label;
+  int break_label;
+  int depth; // Values pushed when the block was deferred
+};
+
+static ColdBlock *cold_blocks;
 int push_pop = 0;
+static int frame_base; // push_pop right after the prologue's push rbp
+
+// Functions defined in the program, which take no variable arguments.
+static Obj **defined;
+static int ndefined;
+
+static void push(char *reg)
+{
+  printf("  push %s\n", reg);
+  push_pop++;
+}
+
+static void pop(char *reg)
+{
+  printf("  pop %s\n", reg);
+  push_pop--;
+}
+
+static void store(Type *ty)
+{
+  if (!ty)
+    error("store: ty is none\n");
+
+  pop("rdi");
+
+  switch (ty->size)
+  {
+  case 1:
+    printf("  mov [rdi], AL\n");
+    break;
+  case 4:
+    printf("  mov [rdi], eax\n");
+    break;
+  case 8:
+    printf("  mov [rdi], rax\n");
+    break;
+  default:
+    error("store: Unexpected size %d", ty->size);
+  }
+}
+
+static bool is_reg_var(Node *node)
+{
+  return node->kind == ND_VAR && node->var->reg;
+}
+
+// Copies register variable `var` into the register named `r64`, or `r32`
+// for values narrower than 64 bits.
+static void load_reg(Obj *var, char *r64, char *r32)
+{
+  int r = var->reg - 1;
+  switch (var->ty->size)
+  {
+  case 1:
+    printf("  movsx %s, %s\n", r32, var_regs8[r]);
+    return;
+  case 4:
+    printf("  mov %s, %s\n", r32, var_regs32[r]);
+    return;
+  case 8:
+    printf("  mov %s, %s\n", r64, var_regs64[r]);
+    return;
+  default:
+    error("load_reg: Unexpected size %d", var->ty->size);
+  }
+}
+
+// Copies the register named `r64`, `r32` or `r8` by size into register
+// variable `var`.
+static void store_reg(Obj *var, char *r64, char *r32, char *r8)
+{
+  int r = var->reg - 1;
+  switch (var->ty->size)
+  {
+  case 1:
+    printf("  mov %s, %s\n", var_regs8[r], r8);
+    return;
+  case 4:
+    printf("  mov %s, %s\n", var_regs32[r], r32);
+    return;
+  case 8:
+    printf("  mov %s, %s\n", var_regs64[r], r64);
+    return;
+  default:
+    error("store_reg: Unexpected size %d", var->ty->size);
+  }
+}
+
+// Saves or restores the callee-saved registers `fn` keeps variables in.
+static void save_regs(Obj *fn, bool save)
+{
+  for (int reg = 1; var_regs64[reg - 1]; reg++)
+  {
+    int offset = saved_reg_offset(fn, reg);
+    if (!offset)
+      continue;
+    if (save)
+      printf("  mov [rbp-%d], %s\n", offset, var_regs64[reg - 1]);
+    else
+      printf("  mov %s, [rbp-%d]\n", var_regs64[reg - 1], offset);
+  }
+}
+
+// Returns true and sets `*val` if `node` is an integer constant.
+static bool const_value(Node *node, int *val)
+{
+  if (node->kind == ND_NUM)
+  {
+    *val = node->val;
+    return true;
+  }
+  if (node->kind == ND_NEG && node->lhs->kind == ND_NUM)
+  {
+    *val = -(unsigned)node->lhs->val;
+    return true;
+  }
+  return false;
+}
+
+// Returns printf-style formatted text in a new string. Operands are only
+// needed while their function is emitted, so they live in the node arena.
+static char *format(char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = arena_alloc(len + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+// Returns the memory operand of a variable on the stack or a global.
+static char *var_mem(Obj *var)
+{
+  if (var->is_local)
+    return format("[rbp-%d]", var->offset);
+  return format("%s[rip]", var->name);
+}
+
+// An lvalue taken apart into the pieces of an x86 memory operand
+// base+index*scale+disp. The base is a variable's own storage (`var`) or a
+// pointer expression; the index is an integer expression.
+typedef struct
+{
+  Obj *var;
+  Node *base;
+  Node *index;
+  int scale;
+  int disp;
+} Addr;
+
+// Returns true and sets `*val` if `node` is a product of constants, as the
+// parser makes of `p + 3`.
+static bool const_offset(Node *node, int *val)
+{
+  if (node->kind == ND_MUL)
+  {
+    int l, r;
+    if (!const_offset(node->lhs, &l) || !const_offset(node->rhs, &r))
+      return false;
+    *val = l * r;
+    return true;
+  }
+  return const_value(node, val);
+}
+
+static bool is_integer(Type *ty)
+{
+  return ty && (ty->tkey == INT || ty->tkey == CHAR);
+}
+
+// Splits the address of `node`, a variable on the stack or in memory or a
+// dereference, into `a`. Constant offsets go to the displacement and one
+// `p + i*scale` to the index.
+static void split_addr(Node *node, Addr *a)
+{
+  *a = (Addr){.scale = 1};
+  if (node->kind == ND_VAR)
+  {
+    a->var = node->var;
+    return;
+  }
+
+  Node *p = node->lhs;
+  for (;;)
+  {
+    if ((p->kind != ND_ADD && p->kind != ND_SUB) || !p->ty || !p->ty->ptr_to)
+      break;
+    int val;
+    if (const_offset(p->rhs, &val))
+    {
+      a->disp += p->kind == ND_ADD ? val : -val;
+      p = p->lhs;
+      continue;
+    }
+    if (p->kind == ND_SUB || a->index)
+      break;
+
+    Node *idx = p->rhs;
+    int scale = 1;
+    if (idx->kind == ND_MUL && idx->rhs->kind == ND_NUM)
+    {
+      scale = idx->rhs->val;
+      idx = idx->lhs;
+    }
+    if ((scale != 1 && scale != 2 && scale != 4 && scale != 8) || !is_integer(idx->ty))
+      break;
+    a->index = idx;
+    a->scale = scale;
+    p = p->lhs;
+  }
+
+  if (p->kind == ND_VAR && p->var->ty->tkey == ARRAY)
+    a->var = p->var;
+  else
+    a->base = p;
+}
+
+// Returns true if `node` is a variable, which needs no code of its own to
+// become a base or an index.
+static bool is_var_part(Node *node)
+{
+  return node->kind == ND_VAR && node->var->ty->tkey != ARRAY;
+}
+
+// Returns true if every piece of `a` is a variable or a constant.
+static bool is_direct_addr(Addr *a)
+{
+  return (!a->base || is_var_part(a->base)) && (!a->index || is_var_part(a->index));
+}
+
+// Returns the register holding the 64-bit value of base variable `node`,
+// loading it into `scratch` unless it lives in a register.
+static char *gen_base(Node *node, char *scratch)
+{
+  Obj *var = node->var;
+  if (var->reg)
+    return var_regs64[var->reg - 1];
+  printf("  mov %s, QWORD PTR %s\n", scratch, var_mem(var));
+  return scratch;
+}
+
+// Like gen_base() for an index variable, sign-extended to 64 bits into
+// `scratch`, since an index may be negative.
+static char *gen_index(Node *node, char *scratch)
+{
+  Obj *var = node->var;
+  if (var->reg && var->ty->size == 4)
+    printf("  movsxd %s, %s\n", scratch, var_regs32[var->reg - 1]);
+  else if (var->reg)
+    printf("  movsx %s, %s\n", scratch, var_regs8[var->reg - 1]);
+  else if (var->ty->size == 1)
+    printf("  movsx %s, BYTE PTR %s\n", scratch, var_mem(var));
+  else
+    printf("  movsxd %s, DWORD PTR %s\n", scratch, var_mem(var));
+  return scratch;
+}
+
+// Emits the code that computes the pieces of `a` and returns its memory
+// operand. Expressions are evaluated into rax, or rax and rdi if both the
+// base and the index need code; variables are loaded into rsi and rdx. A
+// direct address thus leaves rax alone.
+static char *gen_mem(Addr *a)
+{
+  char *base = NULL;
+  char *index = NULL;
+  bool eval_base = a->base && !is_var_part(a->base);
+  bool eval_index = a->index && !is_var_part(a->index);
+
+  if (eval_base && eval_index)
+  {
+    // In source order, which is the order passes like cse assume.
+    gen(a->base);
+    push("rax");
+    gen(a->index);
+    printf("  movsxd rdi, eax\n");
+    pop("rax");
+    base = "rax";
+    index = "rdi";
+  }
+  else if (eval_base)
+  {
+    gen(a->base);
+    base = "rax";
+  }
+  else if (eval_index)
+  {
+    gen(a->index);
+    printf("  movsxd rax, eax\n");
+    index = "rax";
+  }
+
+  if (a->base && !base)
+    base = gen_base(a->base, "rsi");
+  if (a->index && !index)
+    index = gen_index(a->index, "rdx");
+
+  int disp = a->disp;
+  if (a->var && a->var->is_local)
+  {
+    base = "rbp";
+    disp -= a->var->offset;
+  }
+  else if (a->var && !index)
+  {
+    // rip-relative operands take no index.
+    if (disp)
+      return format("%s[rip%+d]", a->var->name, disp);
+    return format("%s[rip]", a->var->name);
+  }
+  else if (a->var)
+  {
+    printf("  lea rsi, %s[rip]\n", a->var->name);
+    base = "rsi";
+  }
+
+  char *mem = index ? format("[%s+%s*%d", base, index, a->scale) : format("[%s", base);
+  if (disp)
+    return format("%s%+d]", mem, disp);
+  return format("%s]", mem);
+}
+
+// Prefixes memory operand `mem` with the size of `ty`.
+static char *sized_mem(Type *ty, char *mem)
+{
+  switch (ty->size)
+  {
+  case 1:
+    return format("BYTE PTR %s", mem);
+  case 4:
+    return format("DWORD PTR %s", mem);
+  case 8:
+    return format("QWORD PTR %s", mem);
+  }
+  error("sized_mem: Unexpected size %d", ty->size);
+  return NULL;
+}
+
+// Loads the value of type `ty` at `mem` into rax. Arrays are not loaded;
+// their value is their address.
+static void load_mem(Type *ty, char *mem)
+{
+  if (!ty || ty->tkey == ARRAY)
+    printf("  lea rax, %s\n", mem);
+  else if (ty->size == 1)
+    printf("  movsx eax, %s\n", sized_mem(ty, mem));
+  else if (ty->size == 4)
+    printf("  mov eax, %s\n", sized_mem(ty, mem));
+  else
+    printf("  mov rax, %s\n", sized_mem(ty, mem));
+}
+
+// Stores rax at `mem` as a value of type `ty`.
+static void store_mem(Type *ty, char *mem)
+{
+  if (ty->size == 1)
+    printf("  mov %s, al\n", sized_mem(ty, mem));
+  else if (ty->size == 4)
+    printf("  mov %s, eax\n", sized_mem(ty, mem));
+  else
+    printf("  mov %s, rax\n", sized_mem(ty, mem));
+}
+
+// Computes the address of lvalue `node` into rax.
+static void gen_addr(Node *node)
+{
+  if (node->kind != ND_VAR && node->kind != ND_DEREF)
+    error("Unexpected node kind: %d", node->kind);
+
+  Addr a;
+  split_addr(node, &a);
+  char *mem = gen_mem(&a);
+  if (strcmp(mem, "[rax]"))
+    printf("  lea rax, %s\n", mem);
+}
+
+// Loads the value of lvalue `node` into rax.
+static void gen_lvalue(Node *node)
+{
+  Addr a;
+  split_addr(node, &a);
+  load_mem(node->ty, gen_mem(&a));
+}
+
+static void gen_assign(Node *node)
+{
+  Addr a;
+  split_addr(node->lhs, &a);
+  if (is_direct_addr(&a))
+  {
+    // Nothing to evaluate for the address, so the rhs can go first and
+    // be stored in place.
+    gen(node->rhs);
+    store_mem(node->ty, gen_mem(&a));
+    return;
+  }
+
+  gen_addr(node->lhs);
+  push("rax");
+  gen(node->rhs);
+  store(node->ty);
+}
+
+// Returns true if `node` is a constant, a variable or a variable's
+// address, which one instruction loads into any register.
+static bool is_simple(Node *node)
+{
+  if (node->kind == ND_NUM || node->kind == ND_VAR)
+    return true;
+  return node->kind == ND_ADDR && node->lhs->kind == ND_VAR;
+}
+
+// Loads simple `node` into the register named `r64`, or `r32` for values
+// narrower than 64 bits, without touching any other register.
+static void gen_simple(Node *node, char *r64, char *r32)
+{
+  if (node->kind == ND_NUM)
+  {
+    printf("  mov %s, %d\n", r32, node->val);
+    return;
+  }
+
+  Obj *var = node->kind == ND_ADDR ? node->lhs->var : node->var;
+  if (var->reg)
+  {
+    load_reg(var, r64, r32);
+    return;
+  }
+
+  char *mem = var_mem(var);
+  if (node->kind == ND_ADDR || var->ty->tkey == ARRAY)
+    printf("  lea %s, %s\n", r64, mem);
+  else if (var->ty->size == 1)
+    printf("  movsx %s, BYTE PTR %s\n", r32, mem);
+  else if (var->ty->size == 4)
+    printf("  mov %s, DWORD PTR %s\n", r32, mem);
+  else
+    printf("  mov %s, QWORD PTR %s\n", r64, mem);
+}
+
+// Evaluates the first six arguments of call `node` into their registers.
+// Arguments that need code of their own go first, through the stack except
+// for the last one; the simple ones are then loaded straight into place.
+static void gen_reg_args(Node *node)
+{
+  Node *args[6];
+  int nargs = 0;
+  for (Node *arg = node->args; arg && nargs < 6; arg = arg->next)
+    args[nargs++] = arg;
+
+  int last = -1;
+  for (int i = 0; i < nargs; i++)
+    if (!is_simple(args[i]))
+      last = i;
+
+  for (int i = 0; i < last; i++)
+  {
+    if (is_simple(args[i]))
+      continue;
+    gen(args[i]);
+    push("rax");
+  }
+  if (last >= 0)
+  {
+    gen(args[last]);
+    printf("  mov %s, rax\n", regards64[last]);
+  }
+  for (int i = last - 1; i >= 0; i--)
+    if (!is_simple(args[i]))
+      pop(regards64[i]);
+
+  for (int i = 0; i < nargs; i++)
+    if (is_simple(args[i]))
+      gen_simple(args[i], regards64[i], regards32[i]);
+}
+
+// Variadic functions take the number of vector registers used in al. Our
+// own functions are never variadic.
+static void gen_vararg_count(char *funcname)
+{
+  for (int i = 0; i < ndefined; i++)
+    if (!strcmp(defined[i]->name, funcname))
+      return;
+  printf("  mov rax, 0\n");
+}
+
+static void gen_funcall(Node *node)
+{
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  // rsp must be a multiple of 16 at the call, and is one right after the
+  // prologue.
+  int nstack = nargs > 6 ? nargs - 6 : 0;
+  int pad = (push_pop - frame_base + nstack) % 2;
+  if (pad)
+  {
+    printf("  sub rsp, 8\n");
+    push_pop++;
+  }
+
+  // Arguments beyond the sixth are pushed from right to left.
+  if (nstack)
+  {
+    Node **stack = calloc(nstack, sizeof(Node *));
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next, i++)
+      if (i >= 6)
+        stack[i - 6] = arg;
+    for (i = nstack - 1; i >= 0; i--)
+    {
+      if (is_simple(stack[i]))
+        gen_simple(stack[i], "rax", "eax");
+      else
+        gen(stack[i]);
+      push("rax");
+    }
+    free(stack);
+  }
+
+  gen_reg_args(node);
+  gen_vararg_count(node->funcname);
+  printf("  call %s\n", node->funcname);
+
+  if (nstack + pad)
+  {
+    printf("  add rsp, %d\n", 8 * (nstack + pad));
+    push_pop -= nstack + pad;
+  }
+}
+
+// Returns true if `fn` has a local whose address may have been passed on.
+static bool has_escaping_locals(Obj *fn)
+{
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+    if (var->addr_taken)
+      return true;
+  return false;
+}
+
+// Emits `return f(...)` as a jump that reuses the current frame. Returns
+// false if the call has to be made normally.
+static bool gen_tail_call(Node *node)
+{
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  // Stack arguments would need our frame, and an argument may point into it.
+  if (nargs > 6 || has_escaping_locals(current_fn))
+    return false;
+
+  // Leaving through another function would skip our exit hook.
+  bool self = !strcmp(node->funcname, current_fn->name) && nargs == current_fn->regards_num;
+  if (opt_instrument_functions && !self)
+    return false;
+
+  gen_reg_args(node);
+
+  // Direct self recursion becomes a loop: jump back to where the prologue
+  // stores the argument registers into the parameters.
+  if (self)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: self tail call turned into a loop\n", current_fn->name);
+    printf("  jmp .L.body.%s\n", current_fn->name);
+    return true;
+  }
+
+  // Release our frame as the epilogue would; the callee then returns
+  // straight to our caller.
+  if (opt_info)
+    fprintf(stderr, "%s: tail call to %s\n", current_fn->name, node->funcname);
+  save_regs(current_fn, false);
+  printf("  mov rsp, rbp\n");
+  printf("  pop rbp\n");
+  gen_vararg_count(node->funcname);
+  printf("  jmp %s\n", node->funcname);
+  return true;
+}
+
+// Evaluates the operands of binary `node` into rax (lhs) and rdi (rhs) and
+// returns the names of the operands to operate on. The rhs may instead be
+// left in memory or be an immediate.
+static void gen_operands(Node *node, char **lreg, char **rreg)
+{
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  int val;
+
+  // Constants belong on the right, where they become immediates.
+  bool commutative = node->kind == ND_ADD || node->kind == ND_MUL ||
+                     node->kind == ND_EQ || node->kind == ND_NE;
+  if (commutative && const_offset(lhs, &val) && !const_offset(rhs, &val))
+  {
+    lhs = node->rhs;
+    rhs = node->lhs;
+  }
+
+  bool wide = lhs->ty->tkey == PTR || lhs->ty->tkey == ARRAY;
+  *lreg = wide ? "rax" : "eax";
+  *rreg = wide ? "rdi" : "edi";
+
+  gen(lhs);
+  // idiv takes no immediate.
+  if (node->kind != ND_DIV && const_offset(rhs, &val))
+  {
+    *rreg = format("%d", val);
+    return;
+  }
+  if (is_reg_var(rhs))
+  {
+    // Nothing to evaluate, so the lhs need not be saved.
+    load_reg(rhs->var, "rdi", "edi");
+    return;
+  }
+
+  // A value of the operation's width in memory at a direct address is
+  // operated on where it is.
+  Addr a;
+  if ((rhs->kind == ND_VAR || rhs->kind == ND_DEREF) && rhs->ty->tkey != ARRAY &&
+      rhs->ty->size == (wide ? 8 : 4))
+  {
+    split_addr(rhs, &a);
+    if (is_direct_addr(&a))
+    {
+      *rreg = sized_mem(rhs->ty, gen_mem(&a));
+      return;
+    }
+  }
+
+  push("rax");
+  gen(rhs);
+  push("rax");
+  pop("rdi");
+  pop("rax");
+}
+
+// Evaluates `node` as a branch condition and jumps to label `<prefix><c>`
+// if its truth is `when`. A comparison sets the flags for the jump directly
+// instead of being materialized as 0 or 1 first.
+static void gen_branch(Node *node, bool when, char *prefix, int c)
+{
+  char *jcc;
+  switch (node->kind)
+  {
+  case ND_NUM:
+    if (!node->val != when)
+      printf("  jmp %s%d\n", prefix, c);
+    return;
+  case ND_EQ:
+    jcc = when ? "je " : "jne";
+    break;
+  case ND_NE:
+    jcc = when ? "jne" : "je ";
+    break;
+  case ND_LT:
+    jcc = when ? "jl " : "jge";
+    break;
+  case ND_LE:
+    jcc = when ? "jle" : "jg ";
+    break;
+  default:
+    gen(node);
+    printf("  cmp rax, 0\n");
+    printf("  %s %s%d\n", when ? "jne" : "je ", prefix, c);
+    return;
+  }
+
+  char *lreg, *rreg;
+  gen_operands(node, &lreg, &rreg);
+  printf("  cmp %s, %s\n", lreg, rreg);
+  printf("  %s %s%d\n", jcc, prefix, c);
+}
+
+// Computes the multiplier and shift that replace signed 32-bit division by
+// `d`, which must not be 0, 1 or -1 (Hacker's Delight, section 10-4).
+static void div_magic(int d, int *mul, int *shift)
+{
+  unsigned two31 = 0x80000000u;
+  unsigned ad = d < 0 ? -(unsigned)d : (unsigned)d;
+  unsigned t = two31 + ((unsigned)d >> 31);
+  unsigned anc = t - 1 - t % ad;
+  unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+  unsigned q2 = two31 / ad, r2 = two31 - q2 * ad;
+  unsigned delta;
+  int p = 31;
+
+  do
+  {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc)
+    {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad)
+    {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *mul = (int)(q2 + 1);
+  if (d < 0)
+    *mul = -(unsigned)*mul;
+  *shift = p - 32;
+}
+
+// Divides eax by the nonzero constant `d`, rounding toward zero like idiv,
+// without a division instruction.
+static void gen_div_const(int d)
+{
+  unsigned ad = d < 0 ? -(unsigned)d : (unsigned)d;
+
+  if (ad == 1)
+  {
+    if (d < 0)
+      printf("  neg eax\n");
+    return;
+  }
+
+  // Powers of two: an arithmetic shift rounds toward negative infinity, so
+  // add 2^k-1 to negative dividends first.
+  if ((ad & (ad - 1)) == 0)
+  {
+    int k = __builtin_ctz(ad);
+    printf("  mov edi, eax\n");
+    printf("  sar edi, 31\n");
+    printf("  shr edi, %d\n", 32 - k);
+    printf("  add eax, edi\n");
+    printf("  sar eax, %d\n", k);
+    if (d < 0)
+      printf("  neg eax\n");
+    return;
+  }
+
+  // Take the high half of the product with the magic number, correct it,
+  // shift, and add one if the quotient is negative.
+  int mul, shift;
+  div_magic(d, &mul, &shift);
+  printf("  movsxd rax, eax\n");
+  printf("  imul rdi, rax, %d\n", mul);
+  printf("  sar rdi, 32\n");
+  if (d > 0 && mul < 0)
+    printf("  add edi, eax\n");
+  if (d < 0 && mul > 0)
+    printf("  sub edi, eax\n");
+  if (shift)
+    printf("  sar edi, %d\n", shift);
+  printf("  mov eax, edi\n");
+  printf("  shr eax, 31\n");
+  printf("  add eax, edi\n");
+}
+
+static int count(void)
+{
+  static int i = 0;
+  return i++;
+}
+
+// Emits the vector part of a counted loop. rcx holds the index, rdx the
+// exclusive bound, r8, r9 and r10 the destination and source bases. The
+// loop runs while a full vector of W elements remains, then stores the
+// index back so the scalar loop can finish.
+static void gen_vecloop(Node *node)
+{
+  VecLoop *vec = node->vec;
+  int c = count();
+  int s = vec->elem_size;
+  int w = (opt_avx2 ? 32 : 16) / s;
+  char *x0 = opt_avx2 ? "ymm0" : "xmm0";
+  char *x1 = opt_avx2 ? "ymm1" : "xmm1";
+  char *x2 = opt_avx2 ? "ymm2" : "xmm2";
+  char *v = opt_avx2 ? "v" : "";
+  char sfx = s == 1 ? 'b' : 'd';
+
+  gen(vec->end);
+  push("rax");
+  gen(vec->dst ? vec->dst : vec->src1);
+  push("rax");
+  gen(vec->src1);
+  push("rax");
+  gen(vec->src2 ? vec->src2 : vec->src1);
+  push("rax");
+  pop("r10");
+  pop("r9");
+  pop("r8");
+  pop("rdx");
+  printf("  movsxd rdx, edx\n");
+  if (vec->inclusive)
+    printf("  add rdx, 1\n");
+
+  gen(new_var_node(vec->index));
+  printf("  movsxd rcx, eax\n");
+  if (vec->op == VEC_SUM && opt_avx2)
+    printf("  vpxor ymm2, ymm2, ymm2\n");
+  else if (vec->op == VEC_SUM)
+    printf("  pxor xmm2, xmm2\n");
+
+  printf(".Lvec.begin.%d:\n", c);
+  printf("  lea rax, [rcx+%d]\n", w);
+  printf("  cmp rax, rdx\n");
+  printf("  jg .Lvec.end.%d\n", c);
+  printf("  %smovdqu %s, [r9+rcx*%d]\n", v, x0, s);
+
+  switch (vec->op)
+  {
+  case VEC_COPY:
+    break;
+  case VEC_ADD:
+  case VEC_SUB:
+    printf("  %smovdqu %s, [r10+rcx*%d]\n", v, x1, s);
+    if (opt_avx2)
+      printf("  vp%s%c %s, %s, %s\n", vec->op == VEC_ADD ? "add" : "sub", sfx, x0, x0, x1);
+    else
+      printf("  p%s%c %s, %s\n", vec->op == VEC_ADD ? "add" : "sub", sfx, x0, x1);
+    break;
+  case VEC_SUM:
+    if (opt_avx2)
+      printf("  vpaddd %s, %s, %s\n", x2, x2, x0);
+    else
+      printf("  paddd %s, %s\n", x2, x0);
+    break;
+  }
 
-static void push(char *reg)
+  if (vec->op != VEC_SUM)
+    printf("  %smovdqu [r8+rcx*%d], %s\n", v, s, x0);
+  printf("  add rcx, %d\n", w);
+  printf("  jmp .Lvec.begin.%d\n", c);
+  printf(".Lvec.end.%d:\n", c);
+
+  if (vec->op == VEC_SUM)
+  {
+    // Fold the lanes into the low dword of xmm2.
+    if (opt_avx2)
+    {
+      printf("  vextracti128 xmm0, ymm2, 1\n");
+      printf("  vpaddd xmm2, xmm2, xmm0\n");
+    }
+    printf("  pshufd xmm0, xmm2, 0x4e\n");
+    printf("  paddd xmm2, xmm0\n");
+    printf("  pshufd xmm0, xmm2, 0xb1\n");
+    printf("  paddd xmm2, xmm0\n");
+  }
+  if (opt_avx2)
+    printf("  vzeroupper\n");
+
+  if (vec->index->reg)
+  {
+    store_reg(vec->index, "rcx", "ecx", "cl");
+  }
+  else
+  {
+    printf("  mov DWORD PTR %s, ecx\n", var_mem(vec->index));
+  }
+
+  if (vec->op == VEC_SUM)
+  {
+    printf("  movd edi, xmm2\n");
+    if (vec->acc->reg)
+    {
+      printf("  add %s, edi\n", var_regs32[vec->acc->reg - 1]);
+    }
+    else
+    {
+      printf("  add DWORD PTR %s, edi\n", var_mem(vec->acc));
+    }
+  }
+}
+
+// -fprofile-generate: increments counter `idx` of `prof_fn`.
+static void count_profile(int idx)
 {
-  printf("  push %s\n", reg);
-  push_pop++;
+  if (opt_profile_generate)
+    printf("  inc QWORD PTR .L.prof.%s[rip+%d]\n", prof_fn->name, idx * 8);
 }
 
-static void pop(char *reg)
+// Counts that `node` went to its true or false side.
+static void count_branch(Node *node, bool side)
 {
-  printf("  pop %s\n", reg);
-  push_pop--;
+  if (node->site)
+    count_profile(side ? 2 * node->site - 1 : 2 * node->site);
 }
 
-static void load(Type *ty)
+// -fprofile-use: sets how often `node` went each way.
+static bool branch_profile(Node *node, long *taken, long *not_taken)
 {
-  if (!ty)
-    return;
-  if (ty->tkey == ARRAY)
-    return;
+  if (!opt_profile_use || !node->site)
+    return false;
+  return profile_branch(prof_fn, node->site, taken, not_taken);
+}
 
-  switch (ty->size)
+// Emits `node` at `.Lcold<c>` after the function, in the cold section.
+static void defer_cold(Node *node, int c)
+{
+  ColdBlock *cb = calloc(1, sizeof(ColdBlock));
+  cb->node = node;
+  cb->c = c;
+  cb->prof_fn = prof_fn;
+  cb->inline_label = inline_label;
+  cb->break_label = break_label;
+  cb->depth = push_pop - frame_base;
+  cb->next = cold_blocks;
+  cold_blocks = cb;
+}
+
+static void gen_if(Node *node)
+{
+  int c = count();
+
+  // A side taken less than one time in ten is moved out of line, so the
+  // common path falls through without a taken jump.
+  long taken, not_taken;
+  if (branch_profile(node, &taken, &not_taken))
   {
-  case 1:
-    printf("  mov AL, BYTE PTR [rax]\n");
-    break;
-  case 4:
-    printf("  mov eax, [rax]\n");
-    break;
-  case 8:
-    printf("  mov rax, [rax]\n");
-    break;
-  default:
-    error("load: Unexpected size %d", ty->size);
+    Node *cold = NULL;
+    Node *hot = NULL;
+    if (taken * 9 < not_taken)
+    {
+      cold = node->then;
+      hot = node->els;
+      gen_branch(node->cond, true, ".Lcold", c);
+    }
+    else if (node->els && not_taken * 9 < taken)
+    {
+      cold = node->els;
+      hot = node->then;
+      gen_branch(node->cond, false, ".Lcold", c);
+    }
+
+    if (cold)
+    {
+      if (hot)
+        gen(hot);
+      printf(".Lend%d:\n", c);
+      defer_cold(cold, c);
+      return;
+    }
   }
+
+  gen_branch(node->cond, false, ".Lelse", c);
+  count_branch(node, true);
+  gen(node->then);
+  if (node->els || opt_profile_generate)
+    printf("  jmp .Lend%d\n", c);
+  printf(".Lelse%d:\n", c);
+  count_branch(node, false);
+  if (node->els)
+    gen(node->els);
+  printf(".Lend%d:\n", c);
 }
 
-static void store(Type *ty)
+static void gen_loop(Node *node)
 {
-  if (!ty)
-    error("store: ty is none\n");
-
-  pop("rdi");
+  int c = count();
+  int outer = break_label;
+  if (node->init)
+    gen(node->init);
+  break_label = c;
 
-  switch (ty->size)
+  // A loop that usually iterates more than once tests its condition at the
+  // bottom, so each iteration takes one branch instead of two.
+  long taken, not_taken;
+  if (node->cond && branch_profile(node, &taken, &not_taken) && taken > not_taken)
   {
-  case 1:
-    printf("  mov [rdi], AL\n");
-    break;
-  case 4:
-    printf("  mov [rdi], eax\n");
-    break;
-  case 8:
-    printf("  mov [rdi], rax\n");
-    break;
-  default:
-    error("store: Unexpected size %d", ty->size);
+    printf("  jmp .Lcond%d\n", c);
+    printf(".Lbegin%d:\n", c);
+    gen(node->then);
+    if (node->inc)
+      gen(node->inc);
+    printf(".Lcond%d:\n", c);
+    gen_branch(node->cond, true, ".Lbegin", c);
+    printf(".Lend%d:\n", c);
+    break_label = outer;
+    return;
   }
+
+  printf(".Lbegin%d:\n", c);
+  if (node->cond)
+    gen_branch(node->cond, false, ".Lend", c);
+  count_branch(node, true);
+  gen(node->then);
+  if (node->inc)
+    gen(node->inc);
+  printf("  jmp .Lbegin%d\n", c);
+  printf(".Lend%d:\n", c);
+  count_branch(node, false);
+  break_label = outer;
 }
 
-static void gen_addr(Node *node)
+typedef struct
+{
+  int val;
+  int label;
+} Case;
+
+// Collects the case labels of a switch body, leaving nested switches out.
+static void collect_cases(Node *node, Node ***cases, int *n, int *cap)
 {
+  if (!node)
+    return;
+
   switch (node->kind)
   {
-  case ND_VAR:
-    if (node->var->is_local)
-    {
-      printf("  mov rax, rbp\n");
-      printf("  sub rax, %d\n", node->var->offset);
-    }
-    else
+  case ND_CASE:
+    if (*n == *cap)
     {
-      printf("  lea rax, %s[rip]\n", node->var->name);
+      *cap = *cap ? *cap * 2 : 16;
+      *cases = realloc(*cases, sizeof(Node *) * *cap);
     }
+    (*cases)[(*n)++] = node;
+    collect_cases(node->then, cases, n, cap);
     return;
-  case ND_DEREF:
-    gen(node->lhs);
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_WHILE:
+  case ND_FOR:
+    collect_cases(node->then, cases, n, cap);
+    collect_cases(node->els, cases, n, cap);
+    return;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      collect_cases(node->block[i], cases, n, cap);
     return;
   default:
-    error("Unexpected node kind: %d", node->kind);
+    return;
   }
 }
 
-static void gen_funcall(Node *node)
+static int compare_cases(const void *a, const void *b)
 {
-  int nargs = 0;
-  for (Node *arg = node->args; arg; arg = arg->next)
+  int x = ((Case *)a)->val;
+  int y = ((Case *)b)->val;
+  return x < y ? -1 : x > y;
+}
+
+// Jumps to the case whose value is in eax among the sorted `cases`, or to
+// `.Lcase<def>`, by comparing against the middle one and halving.
+static void gen_case_search(Case *cases, int n, int def)
+{
+  if (n <= 3)
   {
-    gen(arg);
-    push("rax");
-    nargs++;
+    for (int i = 0; i < n; i++)
+    {
+      printf("  cmp eax, %d\n", cases[i].val);
+      printf("  je .Lcase%d\n", cases[i].label);
+    }
+    printf("  jmp .Lcase%d\n", def);
+    return;
   }
 
-  for (int i = nargs - 1; i >= 0; i--)
+  int mid = n / 2;
+  int c = count();
+  printf("  cmp eax, %d\n", cases[mid].val);
+  printf("  je .Lcase%d\n", cases[mid].label);
+  printf("  jl .Lsearch%d\n", c);
+  gen_case_search(cases + mid + 1, n - mid - 1, def);
+  printf(".Lsearch%d:\n", c);
+  gen_case_search(cases, mid, def);
+}
+
+// Indexes a table of offsets to the case labels with eax - cases[0].val.
+// Values missing from the range go to `.Lcase<def>`.
+static void gen_jump_table(Case *cases, int n, int def)
+{
+  int c = count();
+  unsigned range = (unsigned)cases[n - 1].val - (unsigned)cases[0].val;
+  printf("  sub eax, %d\n", cases[0].val);
+  printf("  cmp eax, %u\n", range);
+  printf("  ja .Lcase%d\n", def);
+  printf("  lea rdi, .Ltable%d[rip]\n", c);
+  printf("  movsxd rax, DWORD PTR [rdi+rax*4]\n");
+  printf("  add rax, rdi\n");
+  printf("  jmp rax\n");
+
+  printf("  .pushsection .rodata\n");
+  printf("  .align 4\n");
+  printf(".Ltable%d:\n", c);
+  for (int i = 0, val = cases[0].val; i < n; val++)
   {
-    pop(regards64[i]);
+    if (cases[i].val == val)
+      printf("  .long .Lcase%d-.Ltable%d\n", cases[i++].label, c);
+    else
+      printf("  .long .Lcase%d-.Ltable%d\n", def, c);
   }
+  printf("  .popsection\n");
+}
 
-  printf("  mov rax, 0\n");
-  printf("  call %s\n", node->funcname);
-  return;
+// Dispatches on the value in eax with a jump table if the case values are
+// dense enough, by binary search if there are many, else by comparing
+// against each in turn.
+static void gen_switch(Node *node)
+{
+  int c = count();
+  Node **labels = NULL;
+  int nlabels = 0, cap = 0;
+  collect_cases(node->then, &labels, &nlabels, &cap);
+
+  Case *cases = calloc(nlabels + 1, sizeof(Case));
+  int n = 0;
+  int def = -1;
+  for (int i = 0; i < nlabels; i++)
+  {
+    Node *label = labels[i];
+    label->label = count();
+    if (!label->cond)
+    {
+      if (def >= 0)
+        error("%s: multiple default labels in one switch", current_fn->name);
+      def = label->label;
+      continue;
+    }
+    cases[n].val = label->cond->val;
+    cases[n].label = label->label;
+    n++;
+  }
+  free(labels);
+
+  qsort(cases, n, sizeof(Case), compare_cases);
+  for (int i = 1; i < n; i++)
+    if (cases[i].val == cases[i - 1].val)
+      error("%s: duplicate case value %d", current_fn->name, cases[i].val);
+
+  // Without a default label, unmatched values leave the switch.
+  bool has_default = def >= 0;
+  if (!has_default)
+    def = count();
+
+  gen(node->cond);
+  if (n >= 4 && (unsigned)cases[n - 1].val - (unsigned)cases[0].val < 3u * n)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: switch with %d cases uses a jump table\n", current_fn->name, n);
+    gen_jump_table(cases, n, def);
+  }
+  else
+  {
+    if (opt_info && n >= 4)
+      fprintf(stderr, "%s: switch with %d cases uses a binary search\n", current_fn->name, n);
+    gen_case_search(cases, n, def);
+  }
+  free(cases);
+
+  int outer = break_label;
+  break_label = c;
+  gen(node->then);
+  break_label = outer;
+  if (!has_default)
+    printf(".Lcase%d:\n", def);
+  printf(".Lend%d:\n", c);
 }
 
 static void gen(Node *node)
 {
-  static unsigned int Lnum = 0; // Lnum is serial number for control statement.
   switch (node->kind)
   {
   case ND_NONE:
@@ -125,57 +1208,54 @@ static void gen(Node *node)
       gen(node->block[i]);
     }
     return;
+  case ND_INLINE:
+  {
+    // `return` in the inlined body leaves the value in rax and jumps here.
+    int c = count();
+    int outer = inline_label;
+    Obj *outer_prof = prof_fn;
+    inline_label = c;
+    prof_fn = node->callee;
+    count_profile(0);
+    for (int i = 0; i < node->block_count; i++)
+      gen(node->block[i]);
+    inline_label = outer;
+    prof_fn = outer_prof;
+    printf(".L.inline.end.%d:\n", c);
+    return;
+  }
   case ND_SIZEOF:
     printf("  mov rax, %d\n", node->ty->size);
     return;
-  case ND_IF:
-    gen(node->cond);
-    printf("  cmp rax, 0\n");
-    printf("  je  .Lend%d\n", Lnum);
-    gen(node->then);
-    printf(".Lend%d:\n", Lnum++);
+  case ND_VECLOOP:
+    gen_vecloop(node);
     return;
+  case ND_IF:
   case ND_IFELSE:
-    gen(node->cond);
-    printf("  cmp rax, 0\n");
-    printf("  je  .Lelse%d\n", Lnum);
-    gen(node->then);
-    printf("  jmp .Lend%d\n", Lnum);
-    printf(".Lelse%d:\n", Lnum);
-    gen(node->els);
-    printf(".Lend%d:\n", Lnum++);
+    gen_if(node);
     return;
   case ND_FOR:
-    if (node->init)
-      gen(node->init);
-    printf(".Lbegin%d:\n", Lnum);
-
-    if (node->cond)
-    {
-      gen(node->cond);
-      printf("  cmp rax, 0\n");
-      printf("  je  .Lend%d\n", Lnum);
-    }
-
-    gen(node->then);
-
-    if (node->inc)
-      gen(node->inc);
-    printf("  jmp .Lbegin%d\n", Lnum);
-    printf(".Lend%d:\n", Lnum);
-    return;
   case ND_WHILE:
-    printf(".Lbegin%d:\n", Lnum);
-    gen(node->cond);
-    printf("  cmp rax, 0\n");
-    printf("  je  .Lend%d\n", Lnum);
+    gen_loop(node);
+    return;
+  case ND_SWITCH:
+    gen_switch(node);
+    return;
+  case ND_CASE:
+    printf(".Lcase%d:\n", node->label);
     gen(node->then);
-    printf("  jmp .Lbegin%d\n", Lnum);
-    printf(".Lend%d:\n", Lnum++);
+    return;
+  case ND_BREAK:
+    printf("  jmp .Lend%d\n", break_label);
     return;
   case ND_RETURN:
+    if (inline_label < 0 && node->lhs->kind == ND_FUNCALL && gen_tail_call(node->lhs))
+      return;
     gen(node->lhs);
-    printf("  jmp .L.return.%s\n", current_fn->name);
+    if (inline_label >= 0)
+      printf("  jmp .L.inline.end.%d\n", inline_label);
+    else
+      printf("  jmp .L.return.%s\n", current_fn->name);
     return;
   case ND_NUM:
     printf("  mov eax, %d\n", node->val);
@@ -185,46 +1265,47 @@ static void gen(Node *node)
     printf("  neg rax\n");
     return;
   case ND_VAR:
-    gen_addr(node);
-    load(node->ty);
+    if (node->var->reg)
+    {
+      load_reg(node->var, "rax", "eax");
+      return;
+    }
+    gen_lvalue(node);
     return;
   case ND_FUNCALL:
     gen_funcall(node);
     return;
   case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push("rax");
-    gen(node->rhs);
-    store(node->ty);
+    if (is_reg_var(node->lhs))
+    {
+      gen(node->rhs);
+      store_reg(node->lhs->var, "rax", "eax", "al");
+      return;
+    }
+    gen_assign(node);
     return;
   case ND_ADDR: // &address
     gen_addr(node->lhs);
     return;
   case ND_DEREF: // *pointer
-    gen(node->lhs);
-    load(node->ty);
+    gen_lvalue(node);
     return;
+  case ND_DIV:
+  {
+    int d;
+    if (const_value(node->rhs, &d) && d != 0 && node->lhs->ty->tkey != PTR)
+    {
+      gen(node->lhs);
+      gen_div_const(d);
+      return;
+    }
+    break;
+  }
   default:
   }
 
-  gen(node->lhs);
-  push("rax");
-  gen(node->rhs);
-  push("rax");
-  pop("rdi");
-  pop("rax");
-
   char *lreg, *rreg;
-  if (node->lhs->ty->tkey == PTR || node->lhs->ty->tkey == ARRAY)
-  {
-    lreg = "rax";
-    rreg = "rdi";
-  }
-  else
-  {
-    lreg = "eax";
-    rreg = "edi";
-  }
+  gen_operands(node, &lreg, &rreg);
 
   switch (node->kind)
   {
@@ -238,23 +1319,27 @@ static void gen(Node *node)
     printf("  imul %s, %s\n", lreg, rreg);
     break;
   case ND_DIV:
-    printf("  cqo\n");
+    // Sign-extend the dividend into rdx:rax or edx:eax.
+    if (lreg[0] == 'r')
+      printf("  cqo\n");
+    else
+      printf("  cdq\n");
     printf("  idiv %s\n", rreg);
     break;
   case ND_EQ:
     printf("  cmp %s, %s\n", lreg, rreg);
     printf("  sete al\n");
-    printf("  movzb %s, al\n", rreg);
+    printf("  movzb %s, al\n", lreg);
     break;
   case ND_NE:
     printf("  cmp %s, %s\n", lreg, rreg);
     printf("  setne al\n");
-    printf("  movzb %s, al\n", rreg);
+    printf("  movzb %s, al\n", lreg);
     break;
   case ND_LT:
     printf("  cmp %s, %s\n", lreg, rreg);
     printf("  setl al\n");
-    printf("  movzb %s, al\n", rreg);
+    printf("  movzb %s, al\n", lreg);
     break;
   case ND_LE:
     printf("  cmp %s, %s\n", lreg, rreg);
@@ -265,50 +1350,146 @@ static void gen(Node *node)
   }
 }
 
-static void store_gp(int i, int offset, int size)
+static void store_gp(int i, Obj *var)
 {
-  printf("  mov rax, rbp\n");
-  printf("  sub rax, %d\n", offset);
+  if (var->reg)
+  {
+    store_reg(var, regards64[i], regards32[i], regards8[i]);
+    return;
+  }
 
-  switch (size)
+  char *mem = sized_mem(var->ty, var_mem(var));
+  switch (var->ty->size)
   {
   case 1:
-    printf("  mov [rax], %s\n", regards8[i]);
+    printf("  mov %s, %s\n", mem, regards8[i]);
     return;
   case 4:
-    printf("  mov [rax], %s\n", regards32[i]);
-    return;
-  case 8:
-    printf("  mov [rax], %s\n", regards64[i]);
+    printf("  mov %s, %s\n", mem, regards32[i]);
     return;
   default:
-    error("store_gp: Unexpected size %d", size);
+    printf("  mov %s, %s\n", mem, regards64[i]);
+  }
+}
+
+// Copies the stack argument at `rbp+offset` into parameter `var`.
+static void store_stack_arg(int offset, Obj *var)
+{
+  int size = var->ty->size;
+  if (size == 1)
+    printf("  movsx eax, BYTE PTR [rbp+%d]\n", offset);
+  else if (size == 4)
+    printf("  mov eax, DWORD PTR [rbp+%d]\n", offset);
+  else
+    printf("  mov rax, QWORD PTR [rbp+%d]\n", offset);
+
+  if (var->reg)
+    store_reg(var, "rax", "eax", "al");
+  else if (size == 1)
+    printf("  mov [rbp-%d], al\n", var->offset);
+  else if (size == 4)
+    printf("  mov [rbp-%d], eax\n", var->offset);
+  else
+    printf("  mov [rbp-%d], rax\n", var->offset);
+}
+
+static int global_align(Type *ty)
+{
+  if (ty->tkey != ARRAY)
+    return ty->size;
+  // Large arrays start on a cache line so a scan over them touches as few
+  // lines as possible.
+  if (ty->size >= 64)
+    return 64;
+  if (ty->size >= 16)
+    return 16;
+  return global_align(ty->ptr_to);
+}
+
+// Emits `len` bytes of `data` as .string if they end in a NUL, else .ascii.
+static void emit_bytes(char *data, int len)
+{
+  char *directive = ".ascii";
+  if (len > 0 && data[len - 1] == '\0')
+  {
+    directive = ".string";
+    len--;
+  }
+
+  printf("  %s \"", directive);
+  for (int i = 0; i < len; i++)
+  {
+    unsigned char c = data[i];
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (isprint(c))
+      putchar(c);
+    else
+      printf("\\%03o", c);
   }
+  printf("\"\n");
 }
 
+// Globals without an initializer go to .bss and take no space in the
+// object file. The only initialized objects are string literals, which are
+// read-only.
 void emit_data(Obj *prog)
 {
+  char *section = NULL;
+
   for (Obj *var = prog; var; var = var->next)
   {
     if (var->is_function)
       continue;
 
-    printf("  .data\n");
-    printf("  .globl %s\n", var->name);
-    printf("%s:\n", var->name);
-
-    if (var->init_data)
+    char *want = var->init_data ? ".section .rodata" : ".bss";
+    if (section != want)
     {
-      for (int i = 0; i < var->ty->size; i++)
-        printf("  .byte %d\n", var->init_data[i]);
+      printf("  %s\n", want);
+      section = want;
     }
-    else
+
+    if (var->init_data)
     {
-      printf("  .zero %d\n", var->ty->size);
+      printf("%s:\n", var->name);
+      emit_bytes(var->init_data, var->ty->size);
+      continue;
     }
+
+    printf("  .globl %s\n", var->name);
+    printf("  .align %d\n", global_align(var->ty));
+    printf("%s:\n", var->name);
+    printf("  .zero %d\n", var->ty->size);
   }
 }
 
+// -finstrument-functions: calls the entry or exit hook of
+// runtime/instrument.c. The argument registers (on entry) or the return
+// value (on exit) are preserved, and the stack is realigned because a call
+// may be made with any alignment.
+static void gen_hook(Obj *fn, bool entry)
+{
+  if (entry)
+    for (int i = 0; i < 6; i++)
+      printf("  push %s\n", regards64[i]);
+  else
+    printf("  push rax\n");
+
+  printf("  lea rdi, .L.instr.%s[rip]\n", fn->name);
+  printf("  mov rax, rsp\n");
+  printf("  and rsp, -16\n");
+  printf("  push rax\n");
+  printf("  push rax\n");
+  printf("  call %s\n", entry ? "__9cc_func_enter" : "__9cc_func_exit");
+  printf("  pop rsp\n");
+
+  if (entry)
+    for (int i = 5; i >= 0; i--)
+      printf("  pop %s\n", regards64[i]);
+  else
+    printf("  pop rax\n");
+}
+
 void emit_text(Obj *prog)
 {
   for (Obj *fn = prog; fn; fn = fn->next)
@@ -316,48 +1497,139 @@ void emit_text(Obj *prog)
     if (!fn->is_function)
       continue;
     current_fn = fn;
+    prof_fn = fn;
 
+    // Functions the profile never saw called go with the cold blocks.
     printf("  .globl %s\n", current_fn->name);
-    printf("  .text\n");
+    if (opt_profile_use && profile_calls(fn) == 0)
+      printf("  .section .text.unlikely,\"ax\",@progbits\n");
+    else
+      printf("  .text\n");
     printf("%s:\n", current_fn->name);
 
     // Allocate memory.
     push("rbp");
+    frame_base = push_pop;
     printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", current_fn->stack_size);
+    if (current_fn->stack_size)
+      printf("  sub rsp, %d\n", current_fn->stack_size);
+    save_regs(current_fn, true);
+    count_profile(0);
+    if (opt_instrument_functions)
+      gen_hook(fn, true);
 
-    // Save passed-by-register arguments to the stack
+    // Move the arguments to where the parameters live. The first six come
+    // in registers, the others above the return address.
+    printf(".L.body.%s:\n", current_fn->name);
     int i = current_fn->regards_num - 1;
     for (Obj *param = current_fn->params; param->next; param = param->next)
     {
-      store_gp(i--, param->offset, param->ty->size);
+      if (i < 6)
+        store_gp(i--, param);
+      else
+        store_stack_arg(16 + 8 * (i-- - 6), param);
     }
 
     // Traverse the AST to emit assembly.
     int code_num = current_fn->stmt_count;
     for (int i = 0; i < code_num; i++)
-    {
-      add_type(current_fn->body[i]);
-    }
-    for (int i = 0; i < code_num; i++)
     {
       gen(current_fn->body[i]);
     }
 
     printf(".L.return.%s:\n", current_fn->name);
+    if (opt_instrument_functions)
+      gen_hook(fn, false);
+    save_regs(current_fn, false);
     printf("  mov rsp, rbp\n");
     pop("rbp");
     printf("  ret\n");
+
+    if (cold_blocks)
+      printf("  .section .text.unlikely,\"ax\",@progbits\n");
+    while (cold_blocks)
+    {
+      ColdBlock *cb = cold_blocks;
+      cold_blocks = cb->next;
+      prof_fn = cb->prof_fn;
+      inline_label = cb->inline_label;
+      break_label = cb->break_label;
+      int balance = push_pop;
+      push_pop = frame_base + cb->depth;
+      printf(".Lcold%d:\n", cb->c);
+      gen(cb->node);
+      printf("  jmp .Lend%d\n", cb->c);
+      push_pop = balance;
+      free(cb);
+    }
+    inline_label = -1;
+    break_label = -1;
+
+    if (opt_instrument_functions)
+    {
+      // { char *name; void *cache; }, passed to the entry hook.
+      printf("  .data\n");
+      printf("  .align 8\n");
+      printf(".L.instr.%s:\n", fn->name);
+      printf("  .quad .L.instr.name.%s\n", fn->name);
+      printf("  .quad 0\n");
+      printf(".L.instr.name.%s:\n", fn->name);
+      printf("  .string \"%s\"\n", fn->name);
+    }
   }
 }
 
+static void check_push_pop(void)
+{
+  if (push_pop != 0)
+    error("pushとpopの数が合わない push - pop = %d\n", push_pop);
+}
+
+static void add_defined(Obj *fn)
+{
+  defined = realloc(defined, sizeof(Obj *) * (ndefined + 1));
+  defined[ndefined++] = fn;
+}
+
 void codegen(Obj *prog)
 {
+  assign_lvar_offsets(prog);
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      add_defined(fn);
+
   printf("  .intel_syntax noprefix\n");
 
   emit_data(prog);
   emit_text(prog);
+  if (opt_profile_generate)
+    emit_profile_counters(prog);
+  check_push_pop();
+}
 
-  if (push_pop != 0)
-    error("pushとpopの数が合わない push - pop = %d\n", push_pop);
+static void start_output(void)
+{
+  static bool started;
+  if (!started)
+    printf("  .intel_syntax noprefix\n");
+  started = true;
+}
+
+// Streaming: each function is emitted as soon as it is ready and the data
+// follows at the end, from codegen_finish(). `fn->next` must be NULL.
+void codegen_function(Obj *fn)
+{
+  start_output();
+  assign_lvar_offsets(fn);
+  add_defined(fn);
+  emit_text(fn);
+  check_push_pop();
+}
+
+void codegen_finish(Obj *prog)
+{
+  start_output();
+  emit_data(prog);
+  if (opt_profile_generate)
+    emit_profile_counters(prog);
 }
\ No newline at end of file
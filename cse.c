@@ -0,0 +1,486 @@
+#include "9cc.h"
+
+// Common subexpression elimination.
+//
+// Statements are walked in execution order while a table records the
+// side-effect-free expressions computed so far. When an expression comes
+// up again while its earlier value is still valid, the first occurrence is
+// turned into `(tmp = expr)` in place and the later one reads `tmp`.
+//
+// Values flow along the dominator tree of the AST: the statements of a
+// block see what the earlier ones computed, and the branches of an `if`
+// see what its condition computed, but nothing computed inside a branch,
+// loop or switch body survives past it. A loop body sees the values from
+// before the loop only if nothing in the loop may change them, and a
+// `case` label only those from before the switch.
+//
+// Assigning a variable invalidates the values that read it. Stores through
+// pointers and calls invalidate every value that reads memory. Statements
+// with calls or nested assignments take no part beyond that, since the
+// order of their side effects is not known here.
+
+typedef struct
+{
+  Node *expr;  // The first occurrence
+  Node **slot; // Where it is, to insert the assignment to `tmp`
+  Obj *tmp;    // Temporary holding the value once it is reused
+  bool killed;
+} Value;
+
+static Value *values;
+static int nvalues;
+static int values_cap;
+
+// Temporaries created by this pass and the expressions they hold.
+static Obj **temps;
+static Node **temp_exprs;
+static int ntemps;
+static int temps_cap;
+
+static Obj *current_fn;
+static int nreused;
+static int case_mark = -1; // nvalues when the innermost switch started
+
+static Node *temp_expr(Obj *var)
+{
+  for (int i = 0; i < ntemps; i++)
+    if (temps[i] == var)
+      return temp_exprs[i];
+  return NULL;
+}
+
+// Looks through the temporaries of this pass to the expressions they stand
+// for, so values compare the same before and after rewriting.
+static Node *skip_temps(Node *node)
+{
+  for (;;)
+  {
+    if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR && temp_expr(node->lhs->var))
+      node = node->rhs;
+    else if (node->kind == ND_VAR && temp_expr(node->var))
+      node = temp_expr(node->var);
+    else
+      return node;
+  }
+}
+
+static bool same_type(Type *a, Type *b)
+{
+  if (!a || !b)
+    return a == b;
+  return a->tkey == b->tkey && a->size == b->size;
+}
+
+static bool same_expr(Node *a, Node *b)
+{
+  if (!a || !b)
+    return a == b;
+  a = skip_temps(a);
+  b = skip_temps(b);
+  if (a->kind != b->kind || !same_type(a->ty, b->ty))
+    return false;
+
+  switch (a->kind)
+  {
+  case ND_NUM:
+    return a->val == b->val;
+  case ND_VAR:
+    return a->var == b->var;
+  case ND_SIZEOF:
+    return a->ty->size == b->ty->size;
+  default:
+    return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+  }
+}
+
+// Returns true if `node` computes a value without side effects.
+static bool is_pure(Node *node)
+{
+  if (!node)
+    return true;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_SIZEOF:
+    return true;
+  case ND_ADDR:
+    return node->lhs->kind == ND_VAR || is_pure(node->lhs);
+  case ND_NEG:
+  case ND_DEREF:
+    return is_pure(node->lhs);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_pure(node->lhs) && is_pure(node->rhs);
+  default:
+    return false;
+  }
+}
+
+// Returns the instructions `node` takes, not counting the address
+// arithmetic that folds into a memory operand.
+static int cost(Node *node)
+{
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_SIZEOF:
+    return 0;
+  case ND_ADDR:
+    return node->lhs->kind == ND_VAR ? 0 : cost(node->lhs->lhs);
+  case ND_NEG:
+    return 1 + cost(node->lhs);
+  case ND_DEREF:
+    return 1 + cost(node->lhs);
+  case ND_ADD:
+  case ND_SUB:
+    if (node->ty && node->ty->ptr_to)
+    {
+      Node *idx = node->rhs;
+      if (idx->kind == ND_MUL && idx->rhs->kind == ND_NUM)
+        idx = idx->lhs;
+      return cost(node->lhs) + cost(idx);
+    }
+    // fallthrough
+  default:
+    return 1 + cost(node->lhs) + cost(node->rhs);
+  }
+}
+
+// Loads are worth keeping in a temporary, and so is arithmetic of more
+// than one instruction.
+static bool is_candidate(Node *node)
+{
+  if (!node->ty || node->ty->tkey == ARRAY || !is_pure(node))
+    return false;
+  return node->kind == ND_DEREF || cost(node) >= 2;
+}
+
+// Returns true if `node` may read variable `var`, or any memory a store
+// through a pointer or a call could change if `var` is NULL.
+static bool reads(Node *node, Obj *var)
+{
+  if (!node)
+    return false;
+  node = skip_temps(node);
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_SIZEOF:
+    return false;
+  case ND_VAR:
+    // The address of an array never changes.
+    if (node->var->ty->tkey == ARRAY)
+      return false;
+    if (var)
+      return node->var == var;
+    return !node->var->is_local || node->var->addr_taken;
+  case ND_ADDR:
+    return node->lhs->kind != ND_VAR && reads(node->lhs->lhs, var);
+  case ND_DEREF:
+    return !var || reads(node->lhs, var);
+  default:
+    return reads(node->lhs, var) || reads(node->rhs, var);
+  }
+}
+
+// Invalidates the values that read `var`, or memory if `var` is NULL.
+static void kill(Obj *var)
+{
+  for (int i = 0; i < nvalues; i++)
+    if (!values[i].killed && reads(values[i].expr, var))
+      values[i].killed = true;
+}
+
+static void kill_all(void)
+{
+  for (int i = 0; i < nvalues; i++)
+    values[i].killed = true;
+}
+
+static void kill_store(Node *lhs)
+{
+  if (lhs->kind == ND_VAR)
+    kill(lhs->var);
+  if (lhs->kind != ND_VAR || !lhs->var->is_local || lhs->var->addr_taken)
+    kill(NULL);
+}
+
+// Invalidates whatever `node` may change when it runs.
+static void kill_effects(Node *node)
+{
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  case ND_VECLOOP:
+  case ND_INLINE:
+    kill_all();
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    kill_effects(node->cond);
+    kill_effects(node->then);
+    kill_effects(node->els);
+    kill_effects(node->init);
+    kill_effects(node->inc);
+    return;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      kill_effects(node->block[i]);
+    return;
+  case ND_FUNCALL:
+    for (Node *arg = node->args; arg; arg = arg->next)
+      kill_effects(arg);
+    kill(NULL);
+    return;
+  case ND_ASSIGN:
+    kill_effects(node->lhs);
+    kill_effects(node->rhs);
+    kill_store(node->lhs);
+    return;
+  default:
+    kill_effects(node->lhs);
+    kill_effects(node->rhs);
+  }
+}
+
+static Value *find_value(Node *node)
+{
+  for (int i = nvalues - 1; i >= 0; i--)
+    if (!values[i].killed && same_expr(values[i].expr, node))
+      return &values[i];
+  return NULL;
+}
+
+static void add_value(Node *node, Node **slot)
+{
+  if (nvalues == values_cap)
+  {
+    values_cap = values_cap ? values_cap * 2 : 64;
+    values = realloc(values, sizeof(Value) * values_cap);
+  }
+  values[nvalues++] = (Value){.expr = node, .slot = slot};
+}
+
+static void add_temp(Obj *tmp, Node *expr)
+{
+  if (ntemps == temps_cap)
+  {
+    temps_cap = temps_cap ? temps_cap * 2 : 64;
+    temps = realloc(temps, sizeof(Obj *) * temps_cap);
+    temp_exprs = realloc(temp_exprs, sizeof(Node *) * temps_cap);
+  }
+  temps[ntemps] = tmp;
+  temp_exprs[ntemps++] = expr;
+}
+
+// Replaces the expression at `slot` with the temporary of `v`, which is
+// assigned where `v` was first computed.
+static void reuse(Value *v, Node **slot)
+{
+  if (!v->tmp)
+  {
+    // Char arithmetic is done in int.
+    Type *ty = v->expr->ty->tkey == CHAR ? ty_int : v->expr->ty;
+    v->tmp = new_temp_lvar(current_fn, ty);
+    add_temp(v->tmp, v->expr);
+
+    Node *assign = new_binary(ND_ASSIGN, new_var_node(v->tmp), *v->slot);
+    assign->ty = ty;
+    *v->slot = assign;
+  }
+
+  *slot = new_var_node(v->tmp);
+  nreused++;
+}
+
+// Rewrites the expression at `slot`, which is evaluated as a value, and
+// records what it computes.
+static void visit_expr(Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  bool candidate = is_candidate(node);
+  if (candidate)
+  {
+    Value *v = find_value(node);
+    if (v)
+    {
+      reuse(v, slot);
+      return;
+    }
+  }
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_SIZEOF:
+    return;
+  case ND_ADDR:
+    if (node->lhs->kind == ND_DEREF)
+      visit_expr(&node->lhs->lhs);
+    break;
+  case ND_ADD:
+  case ND_SUB:
+    // A scaled index folds into the memory operand, so only what is scaled
+    // is worth keeping.
+    if (node->ty->ptr_to && node->rhs->kind == ND_MUL && node->rhs->rhs->kind == ND_NUM)
+    {
+      visit_expr(&node->lhs);
+      visit_expr(&node->rhs->lhs);
+      break;
+    }
+    // fallthrough
+  default:
+    visit_expr(&node->lhs);
+    visit_expr(&node->rhs);
+  }
+
+  if (candidate)
+    add_value(node, slot);
+}
+
+// Handles an expression evaluated for its effect or as a condition.
+static void visit_expr_stmt(Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+  if (node->kind == ND_ASSIGN && is_pure(node->rhs) &&
+      (node->lhs->kind == ND_VAR || (node->lhs->kind == ND_DEREF && is_pure(node->lhs->lhs))))
+  {
+    // The store comes after both sides are evaluated.
+    if (node->lhs->kind == ND_DEREF)
+      visit_expr(&node->lhs->lhs);
+    visit_expr(&node->rhs);
+    kill_store(node->lhs);
+    return;
+  }
+
+  if (is_pure(node))
+    visit_expr(slot);
+  else
+    kill_effects(node);
+}
+
+static void visit_stmt(Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  int mark = nvalues;
+  switch (node->kind)
+  {
+  case ND_NONE:
+  case ND_BREAK:
+    return;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      visit_stmt(&node->block[i]);
+    return;
+  case ND_INLINE:
+  case ND_VECLOOP:
+    kill_all();
+    return;
+  case ND_RETURN:
+    visit_expr_stmt(&node->lhs);
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+    visit_expr_stmt(&node->cond);
+    mark = nvalues;
+    visit_stmt(&node->then);
+    nvalues = mark;
+    visit_stmt(&node->els);
+    nvalues = mark;
+    return;
+  case ND_WHILE:
+  case ND_FOR:
+    if (node->init)
+      visit_expr_stmt(&node->init);
+    mark = nvalues;
+    // The loop body may run after any part of the loop.
+    kill_effects(node->cond);
+    kill_effects(node->then);
+    kill_effects(node->inc);
+    if (node->cond)
+      visit_expr_stmt(&node->cond);
+    visit_stmt(&node->then);
+    if (node->inc)
+      visit_expr_stmt(&node->inc);
+    nvalues = mark;
+    return;
+  case ND_SWITCH:
+  {
+    visit_expr_stmt(&node->cond);
+    int outer = case_mark;
+    case_mark = nvalues;
+    kill_effects(node->then);
+    visit_stmt(&node->then);
+    nvalues = case_mark;
+    case_mark = outer;
+    return;
+  }
+  case ND_CASE:
+    // Reached from the switch as well as from the statement before.
+    nvalues = case_mark;
+    visit_stmt(&node->then);
+    return;
+  default:
+    visit_expr_stmt(slot);
+  }
+}
+
+// Eliminates common subexpressions in every function. Returns the number
+// of expressions replaced by a temporary.
+int eliminate_common_subexprs(Obj *prog)
+{
+  nreused = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function || !fn->body)
+      continue;
+
+    // Escape information for locals and globals.
+    analyze_lvars(fn);
+    current_fn = fn;
+    nvalues = 0;
+    // Temporaries of earlier functions may be freed under --stream.
+    ntemps = 0;
+    int before = nreused;
+    for (int i = 0; i < fn->stmt_count; i++)
+      visit_stmt(&fn->body[i]);
+
+    int n = nreused - before;
+    if (opt_info && n)
+      fprintf(stderr, "%s: reused %d common subexpression%s\n", fn->name, n, n == 1 ? "" : "s");
+  }
+  return nreused;
+}
@@ -0,0 +1,366 @@
+#include "9cc.h"
+
+// Stack frame layout.
+//
+// Each local gets a live range in AST walk order. Scalars whose address is
+// never taken are kept in registers, most used first; the others go to the
+// stack. Locals whose ranges do not overlap share a register or a stack
+// slot, every slot is naturally aligned and the frame is rounded up to 16
+// bytes.
+
+typedef struct Loop Loop;
+struct Loop
+{
+  Loop *next;
+  int begin;
+  int end;
+};
+
+static int pos;          // Current position in walk order
+static int weight;       // Weight of a use at `pos`
+static bool clobbers;    // The function calls out or runs vector loops
+static Loop loops;       // Loops of the current function, innermost first
+static Loop *loops_tail;
+
+// Registers for locals, indexed by Obj::reg - 1 and NULL-terminated. r10
+// and r11 are scratch registers of vector loops and are not preserved
+// across calls, so only functions without either use them. The others are
+// callee-saved: the prologue saves the ones used at the top of the frame.
+char *var_regs64[] = {"r10", "r11", "rbx", "r12", "r13", "r14", "r15", NULL};
+char *var_regs32[] = {"r10d", "r11d", "ebx", "r12d", "r13d", "r14d", "r15d", NULL};
+char *var_regs8[] = {"r10b", "r11b", "bl", "r12b", "r13b", "r14b", "r15b", NULL};
+
+#define NUM_VAR_REGS 7
+#define FIRST_CALLEE_SAVED 3 // Obj::reg of rbx
+
+static void walk(Node *node, bool deref_base);
+
+static void use_var(Obj *var)
+{
+  if (!var->is_local)
+    return;
+  if (var->live_begin > pos)
+    var->live_begin = pos;
+  if (var->live_end < pos)
+    var->live_end = pos;
+  var->weight += weight;
+}
+
+// `&node`: the variable whose address is computed escapes.
+static void walk_addr(Node *node)
+{
+  if (node->kind == ND_VAR)
+  {
+    node->var->addr_taken = true;
+    use_var(node->var);
+    return;
+  }
+  if (node->kind == ND_DEREF)
+  {
+    walk(node->lhs, false);
+    return;
+  }
+  walk(node, false);
+}
+
+// `deref_base` is true if the value of `node` is only used as the address of
+// a load or store, e.g. `a` in `a[i]`. An array used anywhere else decays to
+// a pointer that may outlive any live range we could compute.
+static void walk(Node *node, bool deref_base)
+{
+  if (!node)
+    return;
+  pos++;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  case ND_VAR:
+    if (node->var->ty->tkey == ARRAY && !deref_base)
+      node->var->addr_taken = true;
+    use_var(node->var);
+    return;
+  case ND_ADDR:
+    walk_addr(node->lhs);
+    return;
+  case ND_DEREF:
+    walk(node->lhs, true);
+    return;
+  case ND_VECLOOP:
+    clobbers = true;
+    use_var(node->vec->index);
+    if (node->vec->acc)
+      use_var(node->vec->acc);
+    walk(node->vec->end, false);
+    walk(node->vec->dst, true);
+    walk(node->vec->src1, true);
+    walk(node->vec->src2, true);
+    return;
+  case ND_ASSIGN:
+    // The store happens after the value is computed, so a local whose range
+    // starts in the rhs must not share a place with the one assigned.
+    walk(node->rhs, false);
+    walk(node->lhs, false);
+    return;
+  case ND_ADD:
+  case ND_SUB:
+    walk(node->lhs, deref_base);
+    walk(node->rhs, false);
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+    walk(node->cond, false);
+    walk(node->then, false);
+    walk(node->els, false);
+    return;
+  case ND_WHILE:
+  case ND_FOR:
+  {
+    walk(node->init, false);
+    Loop *loop = calloc(1, sizeof(Loop));
+    loop->begin = pos;
+    // Assume every loop runs about eight times.
+    int outer = weight;
+    if (weight < 1 << 24)
+      weight *= 8;
+    walk(node->cond, false);
+    walk(node->then, false);
+    walk(node->inc, false);
+    weight = outer;
+    loop->end = pos;
+    loops_tail = loops_tail->next = loop;
+    return;
+  }
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      walk(node->block[i], false);
+    return;
+  case ND_FUNCALL:
+    clobbers = true;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      walk(arg, false);
+    return;
+  default:
+    walk(node->lhs, false);
+    walk(node->rhs, false);
+  }
+}
+
+static int align_to(int n, int align)
+{
+  return (n + align - 1) / align * align;
+}
+
+static int var_align(Type *ty)
+{
+  if (ty->tkey != ARRAY)
+    return ty->size;
+  // Like the x86-64 ABI, give arrays of 16 bytes or more a 16-byte boundary.
+  if (ty->size >= 16)
+    return 16;
+  return var_align(ty->ptr_to);
+}
+
+static bool overlaps(Obj *a, Obj *b)
+{
+  return a->live_begin <= b->live_end && b->live_begin <= a->live_end;
+}
+
+// Computes the live range of every local of `fn` and whether its address
+// may escape. Also marks globals whose address is taken.
+void analyze_lvars(Obj *fn)
+{
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+  {
+    var->addr_taken = false;
+    var->live_begin = __INT_MAX__;
+    var->live_end = -1;
+    var->weight = 0;
+  }
+
+  // Parameters are stored by the prologue.
+  pos = 0;
+  weight = 1;
+  clobbers = false;
+  for (Obj *var = fn->params; var->next; var = var->next)
+    use_var(var);
+
+  loops.next = NULL;
+  loops_tail = &loops;
+  for (int i = 0; i < fn->stmt_count; i++)
+    walk(fn->body[i], false);
+  fn->is_leaf = !clobbers;
+
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+  {
+    if (var->addr_taken)
+    {
+      var->live_begin = 0;
+      var->live_end = __INT_MAX__;
+    }
+
+    // A value that is live anywhere in a loop may be needed again on the
+    // next iteration, so it must survive the whole loop. Loops are listed
+    // innermost first, so extending by an inner loop is seen by the outer.
+    for (Loop *loop = loops.next; loop; loop = loop->next)
+      if (var->live_begin <= loop->end && loop->begin <= var->live_end)
+      {
+        if (var->live_begin > loop->begin)
+          var->live_begin = loop->begin;
+        if (var->live_end < loop->end)
+          var->live_end = loop->end;
+      }
+  }
+
+  for (Loop *loop = loops.next, *next; loop; loop = next)
+  {
+    next = loop->next;
+    free(loop);
+  }
+  loops.next = NULL;
+}
+
+static bool is_reg_candidate(Obj *var)
+{
+  return !var->addr_taken && var->weight > 0 && var->ty->tkey != ARRAY;
+}
+
+// Gives registers to the most used scalars. A variable may share a
+// register with the ones whose live ranges it does not overlap.
+static void assign_regs(Obj *fn)
+{
+  int nvars = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+    nvars++;
+
+  // Insertion sort, heaviest first.
+  Obj **vars = calloc(nvars, sizeof(Obj *));
+  int n = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+  {
+    var->reg = 0;
+    if (!is_reg_candidate(var))
+      continue;
+    int i = n++;
+    while (i > 0 && vars[i - 1]->weight < var->weight)
+    {
+      vars[i] = vars[i - 1];
+      i--;
+    }
+    vars[i] = var;
+  }
+
+  int first = fn->is_leaf ? 1 : FIRST_CALLEE_SAVED;
+  fn->saved_regs = 0;
+  for (int i = 0; i < n; i++)
+  {
+    Obj *var = vars[i];
+    for (int reg = first; reg <= NUM_VAR_REGS && !var->reg; reg++)
+    {
+      bool busy = false;
+      for (int j = 0; j < i && !busy; j++)
+        if (vars[j]->reg == reg && overlaps(vars[j], var))
+          busy = true;
+      if (!busy)
+        var->reg = reg;
+    }
+    if (var->reg >= FIRST_CALLEE_SAVED)
+      fn->saved_regs |= 1 << var->reg;
+  }
+  free(vars);
+}
+
+// Returns the frame offset at which callee-saved register `reg` is saved,
+// or 0 if `fn` does not use it.
+int saved_reg_offset(Obj *fn, int reg)
+{
+  if (!(fn->saved_regs & 1 << reg))
+    return 0;
+  return 8 * __builtin_popcount(fn->saved_regs & ((2 << reg) - 1));
+}
+
+static void assign_fn_offsets(Obj *fn)
+{
+  analyze_lvars(fn);
+  assign_regs(fn);
+
+  int nvars = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+    nvars++;
+
+  // Insertion sort, largest alignment first so slots stay packed.
+  Obj **vars = calloc(nvars, sizeof(Obj *));
+  int n = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+  {
+    var->offset = 0;
+    if (var->reg)
+      continue;
+    int i = n++;
+    while (i > 0 && var_align(vars[i - 1]->ty) < var_align(var->ty))
+    {
+      vars[i] = vars[i - 1];
+      i--;
+    }
+    vars[i] = var;
+  }
+
+  // Greedy interval coloring: reuse the first slot that is large enough,
+  // suitably aligned and not occupied during the variable's live range.
+  // Saved registers come first, right below rbp.
+  int stack_size = 8 * __builtin_popcount(fn->saved_regs);
+  for (int i = 0; i < n; i++)
+  {
+    Obj *var = vars[i];
+    int size = var->ty->size;
+    int align = var_align(var->ty);
+    var->offset = 0;
+
+    for (int j = 0; j < i && !var->offset; j++)
+    {
+      Obj *slot = vars[j];
+      if (slot->ty->size < size || slot->offset % align)
+        continue;
+
+      // `slot` must be the owner of the slot, and no variable placed in
+      // it may be live at the same time.
+      bool owner = true;
+      for (int k = 0; k < j; k++)
+        if (vars[k]->offset == slot->offset)
+          owner = false;
+      if (!owner)
+        continue;
+
+      bool busy = false;
+      for (int k = 0; k < i && !busy; k++)
+        if (vars[k]->offset == slot->offset && overlaps(vars[k], var))
+          busy = true;
+      if (!busy)
+        var->offset = slot->offset;
+    }
+
+    if (!var->offset)
+    {
+      stack_size = align_to(stack_size + size, align);
+      var->offset = stack_size;
+    }
+  }
+
+  fn->stack_size = align_to(stack_size, 16);
+  free(vars);
+}
+
+void assign_lvar_offsets(Obj *prog)
+{
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      assign_fn_offsets(fn);
+}
@@ -0,0 +1,431 @@
+#include "9cc.h"
+
+// Function inlining.
+//
+// A call to a small, non-recursive function defined in the same translation
+// unit is replaced by an ND_INLINE node. Its statements bind the arguments to
+// fresh copies of the callee's parameters and then run a copy of the callee's
+// body in which every local is renamed. `return` inside that body jumps to
+// the end of the ND_INLINE node instead of leaving the caller.
+
+typedef struct FnInfo FnInfo;
+struct FnInfo
+{
+  Obj *fn;
+  bool recursive;
+  bool done;
+  int visited; // Search of reaches() that last visited the function
+};
+
+typedef struct VarMap VarMap;
+struct VarMap
+{
+  VarMap *next;
+  Obj *from;
+  Obj *to;
+};
+
+static FnInfo *fns;
+static int nfns;
+static int ninlined;
+static int search; // Number of the current search of reaches()
+
+// Functions by name, open addressing.
+static FnInfo **fn_slots;
+static int fn_cap;
+
+static unsigned hash_name(char *name)
+{
+  unsigned h = 2166136261u;
+  for (char *p = name; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  return h;
+}
+
+static FnInfo *find_fn(char *name)
+{
+  for (int i = hash_name(name) & (fn_cap - 1); fn_slots[i]; i = (i + 1) & (fn_cap - 1))
+    if (!strcmp(fn_slots[i]->fn->name, name))
+      return fn_slots[i];
+  return NULL;
+}
+
+static void index_fns(void)
+{
+  free(fn_slots);
+  fn_cap = 16;
+  while (fn_cap < nfns * 2)
+    fn_cap *= 2;
+  fn_slots = calloc(fn_cap, sizeof(FnInfo *));
+  for (int i = 0; i < nfns; i++)
+  {
+    int j = hash_name(fns[i].fn->name) & (fn_cap - 1);
+    while (fn_slots[j])
+      j = (j + 1) & (fn_cap - 1);
+    fn_slots[j] = &fns[i];
+  }
+}
+
+static int count_nodes(Node *node)
+{
+  if (!node)
+    return 0;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+    return 1;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    return 1 + count_nodes(node->cond) + count_nodes(node->then) +
+           count_nodes(node->els) + count_nodes(node->init) + count_nodes(node->inc);
+  case ND_BLOCK:
+  case ND_INLINE:
+  {
+    int n = 1;
+    for (int i = 0; i < node->block_count; i++)
+      n += count_nodes(node->block[i]);
+    return n;
+  }
+  case ND_FUNCALL:
+  {
+    int n = 1;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      n += count_nodes(arg);
+    return n;
+  }
+  default:
+    return 1 + count_nodes(node->lhs) + count_nodes(node->rhs);
+  }
+}
+
+static int fn_size(Obj *fn)
+{
+  int n = 0;
+  for (int i = 0; i < fn->stmt_count; i++)
+    n += count_nodes(fn->body[i]);
+  return n;
+}
+
+// Returns true if a call to `target` is reachable from `node` through
+// functions defined in this translation unit. Functions already searched
+// for `target` are marked with the current `search`.
+static bool reaches(Node *node, Obj *target)
+{
+  if (!node)
+    return false;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+    return false;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    return reaches(node->cond, target) || reaches(node->then, target) ||
+           reaches(node->els, target) || reaches(node->init, target) ||
+           reaches(node->inc, target);
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      if (reaches(node->block[i], target))
+        return true;
+    return false;
+  case ND_FUNCALL:
+  {
+    for (Node *arg = node->args; arg; arg = arg->next)
+      if (reaches(arg, target))
+        return true;
+
+    FnInfo *info = find_fn(node->funcname);
+    if (!info)
+      return false;
+    if (info->fn == target)
+      return true;
+    if (info->visited == search)
+      return false;
+    info->visited = search;
+    for (int i = 0; i < info->fn->stmt_count; i++)
+      if (reaches(info->fn->body[i], target))
+        return true;
+    return false;
+  }
+  default:
+    return reaches(node->lhs, target) || reaches(node->rhs, target);
+  }
+}
+
+static Obj *map_var(VarMap *map, Obj *var)
+{
+  for (; map; map = map->next)
+    if (map->from == var)
+      return map->to;
+  return var;
+}
+
+static Node *clone(Node *node, VarMap *map)
+{
+  if (!node)
+    return NULL;
+
+  Node *copy = copy_node(node);
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+    break;
+  case ND_VAR:
+    copy->var = map_var(map, node->var);
+    break;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    copy->cond = clone(node->cond, map);
+    copy->then = clone(node->then, map);
+    copy->els = clone(node->els, map);
+    copy->init = clone(node->init, map);
+    copy->inc = clone(node->inc, map);
+    break;
+  case ND_BLOCK:
+  case ND_INLINE:
+    copy->block = arena_alloc(sizeof(Node *) * node->block_count);
+    for (int i = 0; i < node->block_count; i++)
+      copy->block[i] = clone(node->block[i], map);
+    break;
+  case ND_FUNCALL:
+  {
+    Node head = {};
+    Node *cur = &head;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      cur = cur->next = clone(arg, map);
+    copy->args = head.next;
+    break;
+  }
+  default:
+    copy->lhs = clone(node->lhs, map);
+    copy->rhs = clone(node->rhs, map);
+  }
+  return copy;
+}
+
+// Builds the ND_INLINE node that replaces `call`, a call from `caller`
+// to `callee`.
+static Node *inline_call(Obj *caller, Node *call, Obj *callee)
+{
+  // Give every local of the callee a fresh variable in the caller.
+  VarMap *map = NULL;
+  for (Obj *var = *callee->locals; var->next; var = var->next)
+  {
+    Obj *copy = calloc(1, sizeof(Obj));
+    *copy = *var;
+    copy->next = *caller->locals;
+    *caller->locals = copy;
+
+    VarMap *m = calloc(1, sizeof(VarMap));
+    m->from = var;
+    m->to = copy;
+    m->next = map;
+    map = m;
+  }
+
+  // Parameters are listed last-first.
+  int nparams = callee->regards_num;
+  Obj **params = calloc(nparams, sizeof(Obj *));
+  int i = nparams;
+  for (Obj *var = callee->params; var->next; var = var->next)
+    params[--i] = var;
+
+  Node *node = new_node(ND_INLINE);
+  node->callee = callee;
+  node->block_count = nparams + callee->stmt_count;
+  node->block = arena_alloc(sizeof(Node *) * node->block_count);
+
+  i = 0;
+  for (Node *arg = call->args, *next; arg; arg = next, i++)
+  {
+    next = arg->next;
+    arg->next = NULL;
+    Node *assign = new_binary(ND_ASSIGN, new_var_node(map_var(map, params[i])), arg);
+    add_type(assign);
+    node->block[i] = assign;
+  }
+  for (int j = 0; j < callee->stmt_count; j++)
+    node->block[i++] = clone(callee->body[j], map);
+
+  free(params);
+  while (map)
+  {
+    VarMap *next = map->next;
+    free(map);
+    map = next;
+  }
+
+  add_type(node);
+  return node;
+}
+
+static void inline_fn(FnInfo *info);
+
+static void inline_calls(Obj *caller, Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    inline_calls(caller, &node->cond);
+    inline_calls(caller, &node->then);
+    inline_calls(caller, &node->els);
+    inline_calls(caller, &node->init);
+    inline_calls(caller, &node->inc);
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      inline_calls(caller, &node->block[i]);
+    return;
+  case ND_FUNCALL:
+    break;
+  default:
+    inline_calls(caller, &node->lhs);
+    inline_calls(caller, &node->rhs);
+    return;
+  }
+
+  int nargs = 0;
+  for (Node **arg = &node->args; *arg; arg = &(*arg)->next)
+  {
+    Node *next = (*arg)->next;
+    inline_calls(caller, arg);
+    (*arg)->next = next;
+    nargs++;
+  }
+
+  FnInfo *info = find_fn(node->funcname);
+  if (!info || info->fn == caller)
+    return;
+
+  // Inline bottom-up so the callee's own calls are already expanded.
+  inline_fn(info);
+
+  Obj *callee = info->fn;
+  int size = fn_size(callee);
+  if (info->recursive)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: not inlining call to %s: recursive\n", caller->name, callee->name);
+    return;
+  }
+  if (nargs != callee->regards_num)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: not inlining call to %s: argument count mismatch\n", caller->name, callee->name);
+    return;
+  }
+
+  // With a profile, functions never called are not worth growing the
+  // caller for, and hot ones may be larger.
+  int limit = opt_inline_limit;
+  if (opt_profile_use && profile_calls(callee) == 0)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: not inlining call to %s: never called in profile\n", caller->name, callee->name);
+    return;
+  }
+  if (opt_profile_use && profile_hot(callee))
+    limit *= 4;
+
+  if (size > limit)
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: not inlining call to %s: size %d exceeds limit %d\n",
+              caller->name, callee->name, size, limit);
+    return;
+  }
+
+  *slot = inline_call(caller, node, callee);
+  ninlined++;
+  if (opt_info)
+    fprintf(stderr, "%s: inlined call to %s (size %d)\n", caller->name, callee->name, size);
+}
+
+static void inline_fn(FnInfo *info)
+{
+  if (info->done)
+    return;
+  info->done = true;
+
+  for (int i = 0; i < info->fn->stmt_count; i++)
+    inline_calls(info->fn, &info->fn->body[i]);
+}
+
+// Inlines small functions at their call sites. Returns the number of calls
+// inlined.
+int inline_functions(Obj *prog)
+{
+  nfns = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      nfns++;
+
+  free(fns);
+  fns = calloc(nfns ? nfns : 1, sizeof(FnInfo));
+  int i = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      fns[i++].fn = fn;
+  index_fns();
+
+  for (i = 0; i < nfns; i++)
+  {
+    search++;
+    for (int j = 0; j < fns[i].fn->stmt_count && !fns[i].recursive; j++)
+      fns[i].recursive = reaches(fns[i].fn->body[j], fns[i].fn);
+  }
+
+  ninlined = 0;
+  if (opt_inline_limit <= 0)
+    return 0;
+
+  for (i = 0; i < nfns; i++)
+    inline_fn(&fns[i]);
+  return ninlined;
+}
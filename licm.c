@@ -0,0 +1,338 @@
+#include "9cc.h"
+
+// Loop-invariant code motion.
+//
+// For every `for` and `while` loop, side-effect-free expressions whose
+// operands do not change inside the loop are computed once into a temporary
+// before the loop, and the loop reads the temporary instead. Loops are
+// handled innermost first, so an invariant can move out through several
+// levels of nesting.
+
+// What a loop may modify.
+typedef struct Effects Effects;
+struct Effects
+{
+  Obj **writes; // Variables assigned by name
+  int nwrites;
+  int cap;
+  bool has_call;      // Calls may modify globals and escaped locals
+  bool has_ptr_store; // Stores through pointers may modify escaped variables
+};
+
+static Obj *current_fn;
+static int nhoisted;
+
+static void add_write(Effects *fx, Obj *var)
+{
+  for (int i = 0; i < fx->nwrites; i++)
+    if (fx->writes[i] == var)
+      return;
+
+  if (fx->nwrites == fx->cap)
+  {
+    fx->cap = fx->cap ? fx->cap * 2 : 8;
+    fx->writes = realloc(fx->writes, sizeof(Obj *) * fx->cap);
+  }
+  fx->writes[fx->nwrites++] = var;
+}
+
+static void scan_effects(Node *node, Effects *fx)
+{
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  case ND_VECLOOP:
+    add_write(fx, node->vec->index);
+    if (node->vec->acc)
+      add_write(fx, node->vec->acc);
+    if (node->vec->dst)
+      fx->has_ptr_store = true;
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    scan_effects(node->cond, fx);
+    scan_effects(node->then, fx);
+    scan_effects(node->els, fx);
+    scan_effects(node->init, fx);
+    scan_effects(node->inc, fx);
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      scan_effects(node->block[i], fx);
+    return;
+  case ND_FUNCALL:
+    fx->has_call = true;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      scan_effects(arg, fx);
+    return;
+  case ND_ASSIGN:
+    if (node->lhs->kind == ND_VAR)
+      add_write(fx, node->lhs->var);
+    else
+      fx->has_ptr_store = true;
+    scan_effects(node->lhs, fx);
+    scan_effects(node->rhs, fx);
+    return;
+  default:
+    scan_effects(node->lhs, fx);
+    scan_effects(node->rhs, fx);
+  }
+}
+
+static bool var_is_invariant(Obj *var, Effects *fx)
+{
+  // The address of an array never changes.
+  if (var->ty->tkey == ARRAY)
+    return true;
+
+  for (int i = 0; i < fx->nwrites; i++)
+    if (fx->writes[i] == var)
+      return false;
+
+  if (!var->is_local && fx->has_call)
+    return false;
+  if (var->addr_taken && (fx->has_call || fx->has_ptr_store))
+    return false;
+  return true;
+}
+
+// Returns true if `node` evaluates to the same value on every iteration
+// and can be evaluated early without side effects or traps.
+static bool is_invariant(Node *node, Effects *fx)
+{
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_SIZEOF:
+    return true;
+  case ND_VAR:
+    return var_is_invariant(node->var, fx);
+  case ND_ADDR:
+    return node->lhs->kind == ND_VAR;
+  case ND_NEG:
+    return is_invariant(node->lhs, fx);
+  case ND_DIV:
+    // Hoisting must not introduce a division that could trap.
+    if (node->rhs->kind != ND_NUM || node->rhs->val == 0 || node->rhs->val == -1)
+      return false;
+    return is_invariant(node->lhs, fx);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_invariant(node->lhs, fx) && is_invariant(node->rhs, fx);
+  default:
+    return false;
+  }
+}
+
+// Leaves are as cheap to re-evaluate as a temporary is to load.
+static bool is_worth_hoisting(Node *node)
+{
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_SIZEOF:
+  case ND_VAR:
+  case ND_ADDR:
+    return false;
+  default:
+    return true;
+  }
+}
+
+// Replaces every maximal invariant expression under `slot` with a
+// temporary and appends its initialization to `pre`.
+static void hoist(Node **slot, Effects *fx, Node **pre)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  if (is_worth_hoisting(node) && is_invariant(node, fx))
+  {
+    // Arrays decay to pointers, and char arithmetic is done in int.
+    Type *ty = node->ty;
+    if (ty->tkey == ARRAY)
+      ty = pointer_to(ty->ptr_to);
+    else if (ty->tkey == CHAR)
+      ty = ty_int;
+
+    Obj *tmp = new_temp_lvar(current_fn, ty);
+    Node *assign = new_binary(ND_ASSIGN, new_var_node(tmp), node);
+    assign->ty = ty;
+    *pre = (*pre)->next = assign;
+
+    *slot = new_var_node(tmp);
+    nhoisted++;
+    return;
+  }
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    hoist(&node->cond, fx, pre);
+    hoist(&node->then, fx, pre);
+    hoist(&node->els, fx, pre);
+    hoist(&node->init, fx, pre);
+    hoist(&node->inc, fx, pre);
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      hoist(&node->block[i], fx, pre);
+    return;
+  case ND_FUNCALL:
+    for (Node **arg = &node->args; *arg; arg = &(*arg)->next)
+    {
+      Node *next = (*arg)->next;
+      hoist(arg, fx, pre);
+      (*arg)->next = next;
+    }
+    return;
+  default:
+    hoist(&node->lhs, fx, pre);
+    hoist(&node->rhs, fx, pre);
+  }
+}
+
+// Moves the invariants of the loop at `slot` into a preheader. The loop is
+// replaced by a block that runs the `for` initializer, the preheader and
+// then the loop.
+static void hoist_loop(Node **slot)
+{
+  Node *loop = *slot;
+
+  Effects fx = {};
+  scan_effects(loop->cond, &fx);
+  scan_effects(loop->then, &fx);
+  scan_effects(loop->inc, &fx);
+
+  Node head = {};
+  Node *pre = &head;
+  int before = nhoisted;
+  hoist(&loop->cond, &fx, &pre);
+  hoist(&loop->then, &fx, &pre);
+  hoist(&loop->inc, &fx, &pre);
+  free(fx.writes);
+
+  int n = nhoisted - before;
+  if (n == 0)
+    return;
+
+  if (opt_info)
+    fprintf(stderr, "%s: hoisted %d loop-invariant expression%s\n",
+            current_fn->name, n, n == 1 ? "" : "s");
+
+  Node *block = new_node(ND_BLOCK);
+  block->block = arena_alloc(sizeof(Node *) * (n + 2));
+  if (loop->init)
+  {
+    block->block[block->block_count++] = loop->init;
+    loop->init = NULL;
+  }
+  for (Node *stmt = head.next, *next; stmt; stmt = next)
+  {
+    next = stmt->next;
+    stmt->next = NULL;
+    block->block[block->block_count++] = stmt;
+  }
+  block->block[block->block_count++] = loop;
+  *slot = block;
+}
+
+static void visit(Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+  case ND_FOR:
+    visit(&node->cond);
+    visit(&node->then);
+    visit(&node->els);
+    visit(&node->init);
+    visit(&node->inc);
+    if (node->kind == ND_WHILE || node->kind == ND_FOR)
+      hoist_loop(slot);
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      visit(&node->block[i]);
+    return;
+  case ND_FUNCALL:
+    for (Node *arg = node->args; arg; arg = arg->next)
+      visit(&arg);
+    return;
+  default:
+    visit(&node->lhs);
+    visit(&node->rhs);
+  }
+}
+
+// Hoists loop-invariant expressions out of every loop. Returns the number
+// of expressions hoisted.
+int hoist_loop_invariants(Obj *prog)
+{
+  // Escape information for locals and globals.
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function)
+      analyze_lvars(fn);
+
+  nhoisted = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function)
+      continue;
+    current_fn = fn;
+    for (int i = 0; i < fn->stmt_count; i++)
+      visit(&fn->body[i]);
+  }
+  return nhoisted;
+}
@@ -1,18 +1,276 @@
 #include "9cc.h"
 
+// Maximum size, in AST nodes, of a function body that may be inlined.
+int opt_inline_limit = 30;
+// Report optimization decisions on stderr.
+bool opt_info;
+// Use 256-bit AVX2 vectors instead of SSE2 in vectorized loops.
+bool opt_avx2;
+// Stop after this many syntax errors.
+int opt_max_errors = 20;
+// -I directories, NULL-terminated.
+char **include_paths;
+// Instrument branches and calls for profile-guided optimization.
+bool opt_profile_generate;
+// Profile to optimize with, or NULL.
+char *opt_profile_use;
+// Call runtime hooks on every function entry and exit.
+bool opt_instrument_functions;
+// -O level, selecting the default set of optimization passes.
+int opt_level = 2;
+// Print time and changes per optimization pass.
+bool opt_time_report;
+
+static char *input_path;
+static bool stream;
+static char *emit_ast_path;
+static char **load_ast_paths;
+static int load_ast_count;
+
+static void add_include_path(char *dir)
+{
+  static int len;
+  include_paths = realloc(include_paths, sizeof(char *) * (len + 2));
+  include_paths[len++] = dir;
+  include_paths[len] = NULL;
+}
+
+static void usage(char *argv0)
+{
+  error("usage: %s [-O<level>] [-f[no-]<pass>] [--print-after=<pass>] [-ftime-report] [-finline-limit=N] [-fopt-info] [-mavx2] [-fmax-errors=N] [-I<dir>] [-fprofile-generate] [-fprofile-use[=<file>]] [-finstrument-functions] [--stream] [--emit-ast=<out>] [--load-ast=<ast>]... [<file>]", argv0);
+}
+
+static void parse_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strncmp(argv[i], "-finline-limit=", 15))
+    {
+      opt_inline_limit = atoi(argv[i] + 15);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-O"))
+    {
+      opt_level = 1;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-O", 2) && isdigit(argv[i][2]))
+    {
+      opt_level = atoi(argv[i] + 2);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--print-after=", 14))
+    {
+      if (!set_print_after(argv[i] + 14))
+        error("unknown pass: %s", argv[i] + 14);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report"))
+    {
+      opt_time_report = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--stream"))
+    {
+      stream = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--emit-ast=", 11))
+    {
+      emit_ast_path = argv[i] + 11;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--load-ast=", 11))
+    {
+      load_ast_paths = realloc(load_ast_paths, sizeof(char *) * (load_ast_count + 1));
+      load_ast_paths[load_ast_count++] = argv[i] + 11;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-I"))
+    {
+      if (++i == argc)
+        usage(argv[0]);
+      add_include_path(argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-I", 2))
+    {
+      add_include_path(argv[i] + 2);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fmax-errors=", 13))
+    {
+      opt_max_errors = atoi(argv[i] + 13);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate"))
+    {
+      opt_profile_generate = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-use"))
+    {
+      opt_profile_use = "9cc.prof";
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14))
+    {
+      opt_profile_use = argv[i] + 14;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finstrument-functions"))
+    {
+      opt_instrument_functions = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fopt-info"))
+    {
+      opt_info = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mavx2"))
+    {
+      opt_avx2 = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fno-", 5) && set_pass_enabled(argv[i] + 5, false))
+      continue;
+
+    if (!strncmp(argv[i], "-f", 2) && set_pass_enabled(argv[i] + 2, true))
+      continue;
+
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      error("unknown argument: %s", argv[i]);
+
+    if (input_path)
+      usage(argv[0]);
+    input_path = argv[i];
+  }
+
+  if (!input_path && !load_ast_count)
+    usage(argv[0]);
+  if (stream && emit_ast_path)
+    error("--stream cannot be combined with --emit-ast");
+  if (opt_profile_generate && opt_profile_use)
+    error("-fprofile-generate cannot be combined with -fprofile-use");
+}
+
+// Loads the --load-ast files and chains their programs together.
+static Obj *load_asts(void)
+{
+  Obj *prog = NULL;
+  Obj **tail = &prog;
+  for (int i = 0; i < load_ast_count; i++)
+  {
+    *tail = load_ast(load_ast_paths[i]);
+    while (*tail)
+      tail = &(*tail)->next;
+  }
+  return prog;
+}
+
+// Nodes allocated after this belong to the function being streamed.
+static ArenaMark stream_mark;
+
+// Optimizes and emits `fn` on its own. Passes that need the whole program,
+// like inlining, do not run when streaming.
+static void stream_function(Obj *fn)
+{
+  Obj *next = fn->next;
+  fn->next = NULL;
+  run_passes(fn, false);
+  codegen_function(fn);
+  fn->next = next;
+}
+
+// Called by the parser for each function: emits it and frees its body and
+// locals, so only one function's AST is resident at a time.
+static void finish_function(Obj *fn)
+{
+  stream_function(fn);
+
+  for (Obj *var = *fn->locals; var;)
+  {
+    Obj *next = var->next;
+    free(var);
+    var = next;
+  }
+  free(fn->locals);
+  fn->locals = NULL;
+  fn->params = NULL;
+  fn->body = NULL;
+  fn->stmt_count = 0;
+  arena_release(stream_mark);
+}
+
 int main(int argc, char **argv)
 {
-  if (argc != 2)
-    error("%s: invalid number of arguments", argv[0]);
+  parse_args(argc, argv);
+  // An inlined call would not show up in the instrumented profile.
+  if (opt_instrument_functions)
+    set_pass_enabled("inline", false);
+  if (opt_profile_use)
+    load_profile(opt_profile_use);
+
+  // Precompiled parts skip tokenizing and parsing.
+  Obj *prog = load_asts();
+
+  if (stream)
+  {
+    // Functions from AST files are emitted first.
+    for (Obj *fn = prog; fn; fn = fn->next)
+      if (fn->is_function && fn->body)
+        stream_function(fn);
+    stream_mark = arena_mark();
+  }
+
+  if (input_path)
+  {
+    char *filename = input_path;
+    char *input_content = read_file(filename);
+
+    Token *tok = preprocess(new_lexer(filename, input_content));
 
-  char *filename = argv[1];
-  char *input_content = read_file(filename);
+    prog = parse(&tok, prog, stream ? finish_function : NULL);
+    if (error_count)
+      exit(1);
+  }
 
-  Token *tok = tokenize(filename, input_content);
+  if (stream)
+  {
+    codegen_finish(prog);
+    if (opt_time_report)
+      report_passes();
+    return 0;
+  }
 
-  Obj *prog = parse(&tok);
+  if (emit_ast_path)
+  {
+    emit_ast(prog, emit_ast_path);
+    return 0;
+  }
 
+  run_passes(prog, true);
   codegen(prog);
+  if (opt_time_report)
+    report_passes();
 
   return 0;
-}
\ No newline at end of file
+}
@@ -1,16 +1,20 @@
 #include "9cc.h"
 
 Obj *globals;
+// Called with each function as soon as its body is parsed, or NULL.
+static void (*finish_fn)(Obj *fn);
+// Branch sites of the current function so far.
+static int nsites;
+// Enclosing switch statements, and loops and switches `break` can leave.
+static int switch_depth;
+static int break_depth;
 
-static Node *new_node(NodeKind kind);
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs);
-static Node *new_unary(NodeKind kind, Node *lhs);
-static Node *new_num(int val);
 static Obj *find_var(Token **tok, Obj **locals);
 static int type2byte(Type *ty);
 
 /*
-  program    = ( declspec (func | var_init ";") )*
+  program    = declaration*
+  declaration= declspec (func | var_init ";")
   func       = declarator ( "(" func_params ")" ) "{" stmt* "}"
   declarator = ident
   func_params= (param ("," param)*)?
@@ -23,6 +27,10 @@ static int type2byte(Type *ty);
               | "if" "(" expr ")" stmt ("else" stmt)?
               | "while" "(" expr ")" stmt
               | "for" (" expr? ";" expr? ";" expr ")" stmt
+              | "switch" "(" expr ")" stmt
+              | "case" add ":" stmt
+              | "default" ":" stmt
+              | "break" ";"
   expr       = assign
   assign     = equality ("=" assign)?
   equality   = relational ("==" relational | "!=" relational)*
@@ -43,7 +51,7 @@ static int type2byte(Type *ty);
   array_index= ("[" expr "]")?
 */
 
-static Obj *program(Token **tok);
+static Obj *program(Token **tok, Obj *known);
 static Obj *func(Type *type, Token **tok);
 static Obj *declarator(Type *type, Token **tok);
 static void func_params(Token **tok, Obj *fn);
@@ -51,11 +59,13 @@ static Obj *param(Token **tok, Obj *params);
 static Type *declspec(Token **tok);
 static Type *fill_ptr_to(Token **tok, Type *cur);
 static Node *stmt(Token **tok, Obj **locals);
+static Node *stmt_or_skip(Token **tok, Obj **locals);
 static Node *expr(Token **tok, Obj **locals);
 static Node *assign(Token **tok, Obj **locals);
 static Node *equality(Token **tok, Obj **locals);
 static Node *relational(Token **tok, Obj **locals);
 static Node *add(Token **tok, Obj **locals);
+static int eval_const(Node *node, Token **tok);
 static Node *mul(Token **tok, Obj **locals);
 static Node *unary(Token **tok, Obj **locals);
 static Node *primary(Token **tok, Obj **locals);
@@ -68,18 +78,12 @@ static Obj *new_gvar(char *name, Type *ty, Token **tok)
   Obj *var = calloc(1, sizeof(Obj));
   var->len = (*tok)->len;
   int token_type = (*tok)->kind;
-  *tok = (*tok)->next;
+  next_token(tok);
   if (equal(tok, "[") && token_type != TK_STR)
   {
-    *tok = (*tok)->next;
+    next_token(tok);
     int idx = expect_number(tok);
-    int type_size = ty->size;
-    Type *ptr_to = calloc(1, sizeof(Type));
-    ptr_to->tkey = ty->tkey;
-    ty->tkey = ARRAY;
-    ty->size *= idx;
-    ptr_to->size = type_size;
-    ty->ptr_to = ptr_to;
+    ty = array_of(ty, idx);
     expect(tok, "]");
   }
   var->name = name;
@@ -93,7 +97,7 @@ static Obj *new_gvar(char *name, Type *ty, Token **tok)
   return var;
 }
 
-static char *new_unique_name(void)
+char *new_unique_name(void)
 {
   static int id = 0;
   char *buf = calloc(1, 20);
@@ -106,22 +110,127 @@ static Obj *new_anon_gvar(Type *ty, Token **tok)
   return new_gvar(new_unique_name(), ty, tok);
 }
 
+// String literals by contents, open addressing.
+static Obj **literals;
+static int literals_cap;
+static int nliterals;
+
+static unsigned hash_bytes(char *p, int len)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  return h;
+}
+
+static Obj **lookup_literal(char *p, int size)
+{
+  int i = hash_bytes(p, size) & (literals_cap - 1);
+  for (; literals[i]; i = (i + 1) & (literals_cap - 1))
+    if (literals[i]->ty->size == size && !memcmp(literals[i]->init_data, p, size))
+      break;
+  return &literals[i];
+}
+
+// Returns the slot of the literal with `size` bytes at `p`, empty if there
+// is none yet.
+static Obj **find_literal(char *p, int size)
+{
+  if (nliterals * 2 >= literals_cap)
+  {
+    Obj **old = literals;
+    int old_cap = literals_cap;
+    literals_cap = literals_cap ? literals_cap * 2 : 64;
+    literals = calloc(literals_cap, sizeof(Obj *));
+    for (int i = 0; i < old_cap; i++)
+      if (old[i])
+        *lookup_literal(old[i]->init_data, old[i]->ty->size) = old[i];
+    free(old);
+  }
+  return lookup_literal(p, size);
+}
+
+// Identical literals share one read-only object.
 static Obj *new_string_literal(char *p, Type *ty, Token **tok)
 {
+  Obj **slot = find_literal(p, ty->size);
+  if (*slot)
+  {
+    next_token(tok);
+    return *slot;
+  }
+
   Obj *var = new_anon_gvar(ty, tok);
   var->init_data = p;
-  return var;
+  nliterals++;
+  return *slot = var;
+}
+
+// Returns the number of bytes a node of `kind` needs: the common header
+// plus the union member used by that kind.
+size_t node_size(NodeKind kind)
+{
+  switch (kind)
+  {
+  case ND_NUM:
+    return offsetof(Node, val) + sizeof(int);
+  case ND_VAR:
+    return offsetof(Node, var) + sizeof(Obj *);
+  case ND_VECLOOP:
+    return offsetof(Node, vec) + sizeof(VecLoop *);
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_WHILE:
+  case ND_FOR:
+  case ND_SWITCH:
+    return offsetof(Node, site) + sizeof(int);
+  case ND_CASE:
+    return offsetof(Node, label) + sizeof(int);
+  case ND_BLOCK:
+    return offsetof(Node, block_count) + sizeof(int);
+  case ND_INLINE:
+    return offsetof(Node, callee) + sizeof(Obj *);
+  case ND_FUNCALL:
+    return offsetof(Node, args) + sizeof(Node *);
+  case ND_NONE:
+  case ND_BREAK:
+    return offsetof(Node, lhs);
+  default:
+    return offsetof(Node, rhs) + sizeof(Node *);
+  }
 }
 
-static Node *new_node(NodeKind kind)
+Node *new_node(NodeKind kind)
 {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(node_size(kind));
   node->kind = kind;
-  node->eof = false;
   return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs)
+// Returns a shallow copy of `node` with `next` cleared.
+Node *copy_node(Node *node)
+{
+  Node *copy = arena_alloc(node_size(node->kind));
+  memcpy(copy, node, node_size(node->kind));
+  copy->next = NULL;
+  return copy;
+}
+
+// Moves a `next`-linked list of `count` statements into an arena array.
+static Node **new_node_array(Node *list, int count)
+{
+  Node **arr = arena_alloc(sizeof(Node *) * count);
+  for (int i = 0; i < count; i++)
+  {
+    arr[i] = list;
+    list = list->next;
+    arr[i]->next = NULL;
+  }
+  return arr;
+}
+
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs)
 {
   Node *node = new_node(kind);
   node->lhs = lhs;
@@ -129,21 +238,21 @@ static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs)
   return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *lhs)
+Node *new_unary(NodeKind kind, Node *lhs)
 {
   Node *node = new_node(kind);
   node->lhs = lhs;
   return node;
 }
 
-static Node *new_num(int val)
+Node *new_num(int val)
 {
   Node *node = new_node(ND_NUM);
   node->val = val;
   return node;
 }
 
-static Node *new_var_node(Obj *var)
+Node *new_var_node(Obj *var)
 {
   Node *node = new_node(ND_VAR);
   node->var = var;
@@ -189,6 +298,19 @@ static Node *new_sub(Node *lhs, Node *rhs)
   return new_binary(ND_SUB, lhs, new_binary(ND_MUL, rhs, new_num(type2byte(lhs->ty))));
 }
 
+// Creates an anonymous local variable of `fn` for compiler temporaries.
+Obj *new_temp_lvar(Obj *fn, Type *ty)
+{
+  Obj *var = calloc(1, sizeof(Obj));
+  var->name = ".tmp";
+  var->len = 4;
+  var->ty = ty;
+  var->is_local = true;
+  var->next = *fn->locals;
+  *fn->locals = var;
+  return var;
+}
+
 // Search var name rbut not find return NULL.
 Obj *find_var(Token **tok, Obj **locals)
 {
@@ -227,38 +349,127 @@ static int type2byte(Type *ty)
   }
 }
 
-// program = ( declspec (func | var_init ";") )*
-static Obj *program(Token **tok)
+// Skips the rest of a construct that failed to parse: through the next `;`
+// at the current nesting level or a `{ ... }` that closes there, or up to
+// the `}` that ends the enclosing block. At the top level that stray `}`
+// is skipped too.
+static void skip_to_sync(Token **tok, bool top)
 {
-  globals = (Obj *)calloc(1, sizeof(Obj));
-  globals = NULL;
-
+  int depth = 0;
   while (!at_eof(tok))
   {
-
-    Type *type = declspec(tok);
-    if (!type)
-      error_tok(tok, "program: Here should be type. %d\n", (*tok)->kind);
-
-    if (equal_xnext(tok, "(", 1)) // func
+    bool punct = (*tok)->kind == TK_RESERVED;
+    if (punct && equal(tok, "{"))
+      depth++;
+    else if (punct && equal(tok, "}"))
     {
-      Obj *fn = func(type, tok);
-      fn->next = globals;
-      globals = fn;
+      if (depth == 0)
+      {
+        if (top)
+          next_token(tok);
+        return;
+      }
+      if (--depth == 0)
+      {
+        next_token(tok);
+        return;
+      }
     }
-    else // global var
+    else if (punct && depth == 0 && equal(tok, ";"))
     {
-      if ((*tok)->kind != TK_IDENT)
-        error_tok(tok, "program: Here should be ident. %d\n", (*tok)->kind);
-      char *name = (*tok)->str;
-      new_gvar(name, type, tok);
-      expect(tok, ";");
+      next_token(tok);
+      return;
     }
+    next_token(tok);
+  }
+}
+
+// declaration = declspec (func | var_init ";")
+static void declaration(Token **tok)
+{
+  Type *type = declspec(tok);
+  if (!type)
+    error_tok(tok, "program: Here should be type. %d\n", (*tok)->kind);
+
+  if (equal_xnext(tok, "(", 1)) // func
+  {
+    Obj *fn = func(type, tok);
+    if (finish_fn && !error_count)
+      finish_fn(fn);
+    fn->next = globals;
+    globals = fn;
+  }
+  else // global var
+  {
+    if ((*tok)->kind != TK_IDENT)
+      error_tok(tok, "program: Here should be ident. %d\n", (*tok)->kind);
+    char *name = (*tok)->str;
+    new_gvar(name, type, tok);
+    expect(tok, ";");
+  }
+}
+
+// program = declaration*
+//
+// A syntax error is reported and parsing resumes after the statement or
+// declaration that contains it, so one run reports up to opt_max_errors
+// errors.
+static Obj *program(Token **tok, Obj *known)
+{
+  globals = known;
+  // Literals of AST files are shared with those of this file.
+  for (Obj *var = known; var; var = var->next)
+  {
+    if (!var->init_data)
+      continue;
+    Obj **slot = find_literal(var->init_data, var->ty->size);
+    if (!*slot)
+    {
+      nliterals++;
+      *slot = var;
+    }
+  }
+
+  while (!at_eof(tok))
+  {
+    jmp_buf buf;
+    error_recover = &buf;
+    if (setjmp(buf))
+      skip_to_sync(tok, true);
+    else
+      declaration(tok);
+    error_recover = NULL;
   }
 
   return globals;
 }
 
+// Parses a statement. After a syntax error inside it, skips to where
+// parsing can resume and returns an empty statement instead.
+static Node *stmt_or_skip(Token **tok, Obj **locals)
+{
+  jmp_buf buf;
+  jmp_buf *outer = error_recover;
+  int outer_switch = switch_depth;
+  int outer_break = break_depth;
+  error_recover = &buf;
+  if (setjmp(buf))
+  {
+    error_recover = outer;
+    switch_depth = outer_switch;
+    break_depth = outer_break;
+    skip_to_sync(tok, false);
+    // The error has been reported; there is nothing left to parse.
+    if (at_eof(tok))
+      exit(1);
+    return new_node(ND_NONE);
+  }
+
+  Node *node = stmt(tok, locals);
+  error_recover = outer;
+  return node;
+}
+
 // func       = declarator ( "(" func_params ")" ) "{" stmt* "}"
 static Obj *func(Type *type, Token **tok)
 {
@@ -274,27 +485,24 @@ static Obj *func(Type *type, Token **tok)
   expect(tok, "{");
 
   Obj **locals = (Obj **)calloc(1, sizeof(Obj *));
-  *locals = (Obj *)calloc(1, sizeof(Obj));
   *locals = fn->params;
 
-  fn->body = calloc(1, sizeof(Node *));
+  Node head = {};
+  Node *cur = &head;
   fn->stmt_count = 0;
+  nsites = 0;
   while (!consume(tok, "}"))
   {
+    cur = cur->next = stmt_or_skip(tok, locals);
     fn->stmt_count++;
-    fn->body = realloc(fn->body, sizeof(Node *) * fn->stmt_count);
-    fn->body[fn->stmt_count - 1] = stmt(tok, locals);
   }
+  fn->body = new_node_array(head.next, fn->stmt_count);
+  fn->nsites = nsites;
+  for (int i = 0; i < fn->stmt_count; i++)
+    add_type(fn->body[i]);
 
-  int stack_size = 0;
-  for (Obj *var = *locals; var->next; var = var->next)
-  {
-    int size = type2byte(var->ty);
-    stack_size += size;
-    var->ty->size = size;
-  }
+  // Stack offsets are assigned by the frame layout in codegen.
   fn->locals = locals;
-  fn->stack_size = stack_size;
 
   return fn;
 }
@@ -307,7 +515,7 @@ static Obj *declarator(Type *type, Token **tok)
     error_tok(tok, "Here should be Obj name. %d\n", (*tok)->kind);
   fn->ty = type;
   fn->name = (*tok)->str;
-  *tok = (*tok)->next;
+  next_token(tok);
   return fn;
 }
 
@@ -315,10 +523,7 @@ static Obj *declarator(Type *type, Token **tok)
 static void func_params(Token **tok, Obj *fn)
 {
   Obj *params = (Obj *)calloc(1, sizeof(Obj));
-  int offset = 0;
-
   params->next = NULL;
-  params->offset = offset;
 
   Token head = {};
   Token *cur = &head;
@@ -350,33 +555,30 @@ static Obj *param(Token **tok, Obj *params)
   obj->next = params;
   obj->name = (*tok)->str;
   obj->len = (*tok)->len;
-  obj->offset = params->offset + type2byte(type);
   obj->ty = type;
   obj->is_local = true;
   params = obj;
-  *tok = (*tok)->next;
+  next_token(tok);
   return params;
 }
 
 // declspec   = ("int" | "char") fill_ptr_to
 static Type *declspec(Token **tok)
 {
-  Type *cur = calloc(1, sizeof(Type));
+  Type *cur = NULL;
   if ((*tok)->kind != TK_TYPE)
     error_tok(tok, "Here should be type.\n");
 
   if (consume(tok, "int"))
   {
-    cur->tkey = INT;
-    cur->size = 4;
+    cur = ty_int;
     if (equal(tok, "*"))
       cur = fill_ptr_to(tok, cur);
   }
 
   else if (consume(tok, "char"))
   {
-    cur->tkey = CHAR;
-    cur->size = 1;
+    cur = new_type(CHAR, 1, NULL);
     if (equal(tok, "*"))
       cur = fill_ptr_to(tok, cur);
   }
@@ -388,13 +590,7 @@ static Type *declspec(Token **tok)
 static Type *fill_ptr_to(Token **tok, Type *cur)
 {
   while (consume(tok, "*"))
-  {
-    Type *ptr = calloc(1, sizeof(Type));
-    ptr->ptr_to = cur;
-    ptr->tkey = PTR;
-    ptr->size = 8;
-    cur = ptr;
-  }
+    cur = pointer_to(cur);
 
   return cur;
 }
@@ -405,31 +601,31 @@ static Type *fill_ptr_to(Token **tok, Type *cur)
 //            | "if" "(" expr ")" stmt ("else" stmt)?
 //            | "while" "(" expr ")" stmt
 //            | "for" (" expr? ";" expr? ";" expr? ")" stmt
+//            | "switch" "(" expr ")" stmt
+//            | "case" add ":" stmt
+//            | "default" ":" stmt
+//            | "break" ";"
 static Node *stmt(Token **tok, Obj **locals)
 {
   Node *node;
   if (at_eof(tok))
-  {
-    node = calloc(1, sizeof(Node));
-    node->eof = true;
-    return node;
-  }
+    error_tok(tok, "stmt: unexpected end of file\n");
+
+  if (consume(tok, ";"))
+    return new_node(ND_NONE);
 
   if (consume(tok, "{"))
   {
     node = new_node(ND_BLOCK);
-    node->block_size = 4;
-    node->block = calloc(node->block_size, sizeof(Node *));
-    size_t count = 0;
+    Node head = {};
+    Node *cur = &head;
+    int count = 0;
     while (!consume(tok, "}"))
     {
-      if (count > (node->block_size))
-      {
-        (node->block_size) *= 2;
-        node->block = realloc(node->block, sizeof(Node *) * node->block_size);
-      }
-      node->block[count++] = stmt(tok, locals);
+      cur = cur->next = stmt_or_skip(tok, locals);
+      count++;
     }
+    node->block = new_node_array(head.next, count);
     node->block_count = count;
   }
   else if (consume(tok, "return"))
@@ -441,6 +637,7 @@ static Node *stmt(Token **tok, Obj **locals)
   else if (consume(tok, "if"))
   {
     node = new_node(ND_IF);
+    node->site = ++nsites;
     expect(tok, "(");
     node->cond = expr(tok, locals);
     expect(tok, ")");
@@ -455,14 +652,18 @@ static Node *stmt(Token **tok, Obj **locals)
   {
 
     node = new_node(ND_WHILE);
+    node->site = ++nsites;
     expect(tok, "(");
     node->cond = expr(tok, locals);
     expect(tok, ")");
+    break_depth++;
     node->then = stmt(tok, locals);
+    break_depth--;
   }
   else if (consume(tok, "for"))
   {
     node = new_node(ND_FOR);
+    node->site = ++nsites;
     expect(tok, "(");
     if (!consume(tok, ";"))
     {
@@ -479,7 +680,41 @@ static Node *stmt(Token **tok, Obj **locals)
       node->inc = expr(tok, locals);
       expect(tok, ")");
     }
+    break_depth++;
+    node->then = stmt(tok, locals);
+    break_depth--;
+  }
+  else if (consume(tok, "switch"))
+  {
+    node = new_node(ND_SWITCH);
+    expect(tok, "(");
+    node->cond = expr(tok, locals);
+    expect(tok, ")");
+    switch_depth++;
+    break_depth++;
     node->then = stmt(tok, locals);
+    switch_depth--;
+    break_depth--;
+  }
+  else if (equal(tok, "case") || equal(tok, "default"))
+  {
+    if (!switch_depth)
+      error_tok(tok, "case label not within a switch statement\n");
+    node = new_node(ND_CASE);
+    if (consume(tok, "case"))
+      node->cond = new_num(eval_const(add(tok, locals), tok));
+    else
+      next_token(tok);
+    expect(tok, ":");
+    node->then = stmt(tok, locals);
+  }
+  else if (equal(tok, "break"))
+  {
+    if (!break_depth)
+      error_tok(tok, "break statement not within a loop or switch\n");
+    next_token(tok);
+    node = new_node(ND_BREAK);
+    expect(tok, ";");
   }
   else
   {
@@ -489,6 +724,34 @@ static Node *stmt(Token **tok, Obj **locals)
   return node;
 }
 
+// Evaluates the integer constant expression `node`, which ends at `tok`.
+static int eval_const(Node *node, Token **tok)
+{
+  switch (node->kind)
+  {
+  case ND_NUM:
+    return node->val;
+  case ND_NEG:
+    return -eval_const(node->lhs, tok);
+  case ND_ADD:
+    return eval_const(node->lhs, tok) + eval_const(node->rhs, tok);
+  case ND_SUB:
+    return eval_const(node->lhs, tok) - eval_const(node->rhs, tok);
+  case ND_MUL:
+    return eval_const(node->lhs, tok) * eval_const(node->rhs, tok);
+  case ND_DIV:
+  {
+    int d = eval_const(node->rhs, tok);
+    if (d == 0)
+      error_tok(tok, "division by zero in a case label\n");
+    return eval_const(node->lhs, tok) / d;
+  }
+  default:
+    error_tok(tok, "case label is not an integer constant\n");
+    return 0;
+  }
+}
+
 // expr = assign
 static Node *expr(Token **tok, Obj **locals)
 {
@@ -633,7 +896,7 @@ static Node *primary(Token **tok, Obj **locals)
     if (!var)
       error_tok(tok, "変数が未定義です\n");
 
-    *tok = (*tok)->next;
+    next_token(tok);
 
     if (equal(tok, "[")) // Array
     {
@@ -649,18 +912,9 @@ static Node *primary(Token **tok, Obj **locals)
 
   if ((*tok)->kind == TK_STR)
   {
-    Type *ty = calloc(1, sizeof(Type));
-    Type *ptr_to = calloc(1, sizeof(Type));
+    Type *ty = array_of(new_type(CHAR, 1, NULL), (*tok)->len + 1);
     char *str = (*tok)->str;
 
-    ty->tkey = ARRAY;
-    ty->size = (*tok)->len + 1;
-
-    ptr_to->tkey = CHAR;
-    ptr_to->size = 1;
-
-    ty->ptr_to = ptr_to;
-
     Obj *var = new_string_literal(str, ty, tok);
 
     if (equal(tok, "[")) // return character
@@ -681,7 +935,8 @@ static Node *primary(Token **tok, Obj **locals)
     return node;
   }
 
-  return new_node(ND_NONE);
+  error_tok(tok, "expected an expression");
+  return NULL;
 }
 
 //   var_init   = ident ("[" num "]")?
@@ -699,28 +954,19 @@ static Node *var_init(Type *type, Token **tok, Obj **vars)
   var->len = (*tok)->len;
   var->next = *vars;
   var->is_local = true;
-  *tok = (*tok)->next;
+  next_token(tok);
 
   if (consume(tok, "[")) // Array
   {
     int idx = expect_number(tok);
     expect(tok, "]");
 
-    int type_size = type->size;
-    var->offset = (*vars)->offset + type_size * idx;
-    type->size *= idx;
-    Type *ty = calloc(1, sizeof(Type));
-    ty->tkey = type->tkey;
-    ty->size = type_size;
-    type->tkey = ARRAY;
-    type->ptr_to = ty;
-    var->ty = type;
+    var->ty = array_of(type, idx);
     *vars = var;
     return new_unary(ND_DEREF, new_var_node(var));
   }
   else // Normal var
   {
-    var->offset = (*vars)->offset + type2byte(type);
     var->ty = type;
     *vars = var;
     return new_var_node(var);
@@ -730,8 +976,10 @@ static Node *var_init(Type *type, Token **tok, Obj **vars)
 // funcall    = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **tok, Obj **locals)
 {
-  Token *start = *tok;
-  *tok = (*tok)->next->next;
+  // Identifiers are interned, so the name needs no copy of its own.
+  char *funcname = (*tok)->str;
+  next_token(tok);
+  next_token(tok);
 
   Node head = {};
   Node *cur = &head;
@@ -746,7 +994,7 @@ static Node *funcall(Token **tok, Obj **locals)
   expect(tok, ")");
 
   Node *node = new_node(ND_FUNCALL);
-  node->funcname = mystrndup(start->str, start->len);
+  node->funcname = funcname;
   node->args = head.next;
   return node;
 }
@@ -754,13 +1002,18 @@ static Node *funcall(Token **tok, Obj **locals)
 // array_index = ("[" expr "]")?
 static Node *array_index(Token **tok, Obj **locals)
 {
-  *tok = (*tok)->next; // skip
+  next_token(tok); // skip
   Node *node_idx = expr(tok, locals);
   expect(tok, "]");
   return node_idx;
 }
 
-Obj *parse(Token **tok)
+// Parses a translation unit. `known` lists globals and functions that are
+// already defined, e.g. loaded from AST files; they stay at the end of the
+// returned list. If `finish` is given, it is called with each function
+// before the function is added to the list.
+Obj *parse(Token **tok, Obj *known, void (*finish)(Obj *fn))
 {
-  return program(tok);
+  finish_fn = finish;
+  return program(tok, known);
 }
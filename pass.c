@@ -0,0 +1,368 @@
+#include "9cc.h"
+#include <time.h>
+
+// Optimization pass manager.
+//
+// The passes run in the order of the table below. -O<n> enables those
+// whose level is at most n, and -f<pass> / -fno-<pass> then turn single
+// passes on or off. Every pass returns the number of changes it made;
+// -ftime-report prints those and the time spent per pass at the end, and
+// --print-after=<pass> dumps the AST on stderr after the pass ran.
+
+typedef struct
+{
+  char *name;
+  int (*run)(Obj *prog);
+  int level;          // Lowest -O level that enables the pass
+  bool whole_program; // Needs all functions at once, so not run by --stream
+  int enabled;        // 1 or 0 if set by -f<pass> or -fno-<pass>, else -1
+  bool print_after;
+  int runs;
+  long changes;
+  clock_t time;
+} Pass;
+
+static Pass passes[] = {
+    {.name = "inline", .run = inline_functions, .level = 2, .whole_program = true, .enabled = -1},
+    {.name = "sccp", .run = propagate_constants, .level = 1, .enabled = -1},
+    {.name = "licm", .run = hoist_loop_invariants, .level = 1, .enabled = -1},
+    {.name = "vectorize", .run = vectorize_loops, .level = 2, .enabled = -1},
+    {.name = "cse", .run = eliminate_common_subexprs, .level = 1, .enabled = -1},
+};
+
+#define NPASSES ((int)(sizeof(passes) / sizeof(*passes)))
+
+static Pass *find_pass(char *name)
+{
+  for (int i = 0; i < NPASSES; i++)
+    if (!strcmp(passes[i].name, name))
+      return &passes[i];
+  return NULL;
+}
+
+// Turns pass `name` on or off regardless of the -O level. Returns false if
+// there is no such pass.
+bool set_pass_enabled(char *name, bool on)
+{
+  Pass *p = find_pass(name);
+  if (!p)
+    return false;
+  p->enabled = on;
+  return true;
+}
+
+// Requests an AST dump after pass `name`. Returns false if there is no
+// such pass.
+bool set_print_after(char *name)
+{
+  Pass *p = find_pass(name);
+  if (!p)
+    return false;
+  p->print_after = true;
+  return true;
+}
+
+static bool is_enabled(Pass *p)
+{
+  if (p->enabled >= 0)
+    return p->enabled;
+  return opt_level >= p->level;
+}
+
+// Runs the enabled passes over `prog`. With `whole_program` false only
+// `prog` itself is available, as with --stream, and passes that need the
+// rest of the program are skipped.
+void run_passes(Obj *prog, bool whole_program)
+{
+  for (int i = 0; i < NPASSES; i++)
+  {
+    Pass *p = &passes[i];
+    if (!is_enabled(p) || (p->whole_program && !whole_program))
+      continue;
+
+    clock_t start = clock();
+    p->changes += p->run(prog);
+    p->time += clock() - start;
+    p->runs++;
+
+    if (p->print_after)
+    {
+      fprintf(stderr, "*** AST after %s ***\n", p->name);
+      print_ast(prog, stderr);
+    }
+  }
+}
+
+// Prints the -ftime-report table.
+void report_passes(void)
+{
+  fprintf(stderr, "%-12s %6s %8s %10s\n", "pass", "runs", "changes", "time (ms)");
+  for (int i = 0; i < NPASSES; i++)
+  {
+    Pass *p = &passes[i];
+    if (!p->runs)
+      continue;
+    fprintf(stderr, "%-12s %6d %8ld %10.3f\n", p->name, p->runs, p->changes,
+            1000.0 * p->time / CLOCKS_PER_SEC);
+  }
+}
+
+//
+// AST dump
+//
+
+// Indentation of the statement being printed.
+static int stmt_depth;
+
+static void print_expr(Node *node, FILE *out);
+static void print_stmt(Node *node, int depth, FILE *out);
+static void indent(int depth, FILE *out);
+
+static char *binary_op(NodeKind kind)
+{
+  switch (kind)
+  {
+  case ND_ADD:
+    return "+";
+  case ND_SUB:
+    return "-";
+  case ND_MUL:
+    return "*";
+  case ND_DIV:
+    return "/";
+  case ND_EQ:
+    return "==";
+  case ND_NE:
+    return "!=";
+  case ND_LT:
+    return "<";
+  case ND_LE:
+    return "<=";
+  case ND_ASSIGN:
+    return "=";
+  default:
+    return NULL;
+  }
+}
+
+static char *vec_op(VecOp op)
+{
+  switch (op)
+  {
+  case VEC_COPY:
+    return "copy";
+  case VEC_ADD:
+    return "add";
+  case VEC_SUB:
+    return "sub";
+  case VEC_SUM:
+    return "sum";
+  }
+  return "?";
+}
+
+static void print_expr(Node *node, FILE *out)
+{
+  if (!node)
+    return;
+
+  char *op = binary_op(node->kind);
+  if (op)
+  {
+    fprintf(out, "(");
+    print_expr(node->lhs, out);
+    fprintf(out, " %s ", op);
+    print_expr(node->rhs, out);
+    fprintf(out, ")");
+    return;
+  }
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+    fprintf(out, "%d", node->val);
+    return;
+  case ND_VAR:
+    fprintf(out, "%s", node->var->name);
+    return;
+  case ND_NEG:
+    fprintf(out, "-");
+    print_expr(node->lhs, out);
+    return;
+  case ND_ADDR:
+    fprintf(out, "&");
+    print_expr(node->lhs, out);
+    return;
+  case ND_DEREF:
+    fprintf(out, "*");
+    print_expr(node->lhs, out);
+    return;
+  case ND_SIZEOF:
+    fprintf(out, "sizeof ");
+    print_expr(node->lhs, out);
+    return;
+  case ND_FUNCALL:
+    fprintf(out, "%s(", node->funcname);
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+      print_expr(arg, out);
+      if (arg->next)
+        fprintf(out, ", ");
+    }
+    fprintf(out, ")");
+    return;
+  case ND_INLINE:
+  {
+    // An inlined call used as a value.
+    int depth = stmt_depth;
+    fprintf(out, "inline %s {\n", node->callee->name);
+    for (int i = 0; i < node->block_count; i++)
+      print_stmt(node->block[i], depth + 1, out);
+    indent(depth, out);
+    fprintf(out, "}");
+    stmt_depth = depth;
+    return;
+  }
+  default:
+    fprintf(out, "<%d>", node->kind);
+  }
+}
+
+static void indent(int depth, FILE *out)
+{
+  fprintf(out, "%*s", depth * 2, "");
+}
+
+static void print_stmt(Node *node, int depth, FILE *out)
+{
+  stmt_depth = depth;
+  indent(depth, out);
+  if (!node)
+  {
+    fprintf(out, ";\n");
+    return;
+  }
+
+  switch (node->kind)
+  {
+  case ND_NONE:
+    fprintf(out, ";\n");
+    return;
+  case ND_RETURN:
+    fprintf(out, "return ");
+    print_expr(node->lhs, out);
+    fprintf(out, ";\n");
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+    fprintf(out, "if (");
+    print_expr(node->cond, out);
+    fprintf(out, ")\n");
+    print_stmt(node->then, depth + 1, out);
+    if (node->kind == ND_IFELSE)
+    {
+      indent(depth, out);
+      fprintf(out, "else\n");
+      print_stmt(node->els, depth + 1, out);
+    }
+    return;
+  case ND_WHILE:
+    fprintf(out, "while (");
+    print_expr(node->cond, out);
+    fprintf(out, ")\n");
+    print_stmt(node->then, depth + 1, out);
+    return;
+  case ND_FOR:
+    fprintf(out, "for (");
+    print_expr(node->init, out);
+    fprintf(out, "; ");
+    print_expr(node->cond, out);
+    fprintf(out, "; ");
+    print_expr(node->inc, out);
+    fprintf(out, ")\n");
+    print_stmt(node->then, depth + 1, out);
+    return;
+  case ND_SWITCH:
+    fprintf(out, "switch (");
+    print_expr(node->cond, out);
+    fprintf(out, ")\n");
+    print_stmt(node->then, depth + 1, out);
+    return;
+  case ND_CASE:
+    if (node->cond)
+      fprintf(out, "case %d:\n", node->cond->val);
+    else
+      fprintf(out, "default:\n");
+    print_stmt(node->then, depth + 1, out);
+    return;
+  case ND_BREAK:
+    fprintf(out, "break;\n");
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    if (node->kind == ND_INLINE)
+      fprintf(out, "inline %s ", node->callee->name);
+    fprintf(out, "{\n");
+    for (int i = 0; i < node->block_count; i++)
+      print_stmt(node->block[i], depth + 1, out);
+    indent(depth, out);
+    fprintf(out, "}\n");
+    return;
+  case ND_VECLOOP:
+  {
+    VecLoop *vec = node->vec;
+    fprintf(out, "vector %s x%d (%s %s ", vec_op(vec->op), vec->elem_size,
+            vec->index->name, vec->inclusive ? "<=" : "<");
+    print_expr(vec->end, out);
+    fprintf(out, ")");
+    if (vec->acc)
+      fprintf(out, " acc=%s", vec->acc->name);
+    if (vec->dst)
+    {
+      fprintf(out, " dst=");
+      print_expr(vec->dst, out);
+    }
+    fprintf(out, " src=");
+    print_expr(vec->src1, out);
+    if (vec->src2)
+    {
+      fprintf(out, ", ");
+      print_expr(vec->src2, out);
+    }
+    fprintf(out, ";\n");
+    return;
+  }
+  default:
+    print_expr(node, out);
+    fprintf(out, ";\n");
+  }
+}
+
+// Parameters are listed last to first, ending with an unnamed sentinel.
+static void print_params(Obj *param, FILE *out)
+{
+  if (!param->next)
+    return;
+  print_params(param->next, out);
+  if (param->next->next)
+    fprintf(out, ", ");
+  fprintf(out, "%s", param->name);
+}
+
+// Prints the functions of `prog` as C-like text.
+void print_ast(Obj *prog, FILE *out)
+{
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function || !fn->body)
+      continue;
+
+    fprintf(out, "%s(", fn->name);
+    if (fn->params)
+      print_params(fn->params, out);
+    fprintf(out, ")\n{\n");
+    for (int i = 0; i < fn->stmt_count; i++)
+      print_stmt(fn->body[i], 1, out);
+    fprintf(out, "}\n");
+  }
+}
@@ -0,0 +1,891 @@
+#include "9cc.h"
+
+// Preprocessor.
+//
+// Handles #include, #define, #undef and #if/#ifdef/#ifndef/#elif/#else/
+// #endif, expanding macros in the rest of the tokens. The main file is not
+// tokenized up front: the parser pulls each token through pp_next(), which
+// pulls from the lexer in turn. Only tokens the preprocessor must keep, such
+// as macro bodies and arguments, are copied out of the lexer's ring.
+//
+// Each header is read and tokenized once per process; later #includes copy
+// its cached tokens, and a header wrapped in an include guard is skipped
+// entirely once the guard macro is defined.
+
+typedef struct Macro Macro;
+struct Macro
+{
+  Macro *next;
+  char *name;
+  bool is_objlike; // Object-like or function-like
+  char **params;
+  int nparams;
+  Token *body; // Terminated by TK_EOF
+};
+
+// Macros that must not be expanded again within a token's expansion.
+struct Hideset
+{
+  Hideset *next;
+  char *name;
+};
+
+// A tokenized header.
+typedef struct IncludeFile IncludeFile;
+struct IncludeFile
+{
+  IncludeFile *next;
+  char *path;
+  Token *tokens;
+  char *guard; // Include guard macro, or NULL
+};
+
+// #if nesting.
+typedef struct CondIncl CondIncl;
+struct CondIncl
+{
+  CondIncl *next;
+  Token *tok;
+  bool in_else;
+  bool included; // Some branch has been taken
+};
+
+static Macro *macros;
+static IncludeFile *include_cache;
+static CondIncl *cond_incl;
+
+// Input. `pending` holds tokens from macro expansions and included files,
+// which are read before the rest of the main file from `lexer`. `peeked` is
+// a token already taken from the lexer; it follows everything in `pending`.
+static Lexer *lexer;
+static Token *pending;
+static Token *peeked;
+
+static bool is_directive(Token *tok, char *name)
+{
+  return is_hash(tok) && equal(&tok->next, name);
+}
+
+static Token *copy_token(Token *tok)
+{
+  Token *t = calloc(1, sizeof(Token));
+  *t = *tok;
+  t->next = NULL;
+  return t;
+}
+
+static Token *new_eof(Token *tok)
+{
+  Token *t = copy_token(tok);
+  t->kind = TK_EOF;
+  t->str = "";
+  t->len = 0;
+  return t;
+}
+
+// Returns the next input token without consuming it.
+static Token *peek_token(void)
+{
+  if (pending)
+    return pending;
+  if (!peeked)
+    peeked = lex(lexer);
+  return peeked;
+}
+
+// Consumes the next input token. A token from the lexer is only valid until
+// the lexer reuses its slot.
+static Token *read_token(void)
+{
+  Token *tok = peek_token();
+  if (tok == pending)
+    pending = tok->next;
+  else
+    peeked = NULL;
+  return tok;
+}
+
+// Puts `tok` back in front of the input.
+static void unread_token(Token *tok)
+{
+  Token *t = copy_token(tok);
+  t->next = pending;
+  pending = t;
+}
+
+// Returns the first token of the next line of the list `tok`.
+static Token *next_line(Token *tok)
+{
+  while (!tok->at_bol)
+    tok = tok->next;
+  return tok;
+}
+
+// Skips the rest of the current line of input.
+static void skip_line(void)
+{
+  while (!peek_token()->at_bol)
+    read_token();
+}
+
+// Reads the rest of the current line into a list terminated by TK_EOF.
+static Token *copy_line(void)
+{
+  Token head = {};
+  Token *cur = &head;
+  while (!peek_token()->at_bol)
+    cur = cur->next = copy_token(read_token());
+  cur->next = new_eof(peek_token());
+  return head.next;
+}
+
+// Returns a copy of the list `tok` (up to TK_EOF) followed by `rest`.
+static Token *append(Token *tok, Token *rest)
+{
+  Token head = {};
+  Token *cur = &head;
+  for (; tok->kind != TK_EOF; tok = tok->next)
+    cur = cur->next = copy_token(tok);
+  cur->next = rest;
+  return head.next;
+}
+
+static Hideset *new_hideset(char *name)
+{
+  Hideset *hs = calloc(1, sizeof(Hideset));
+  hs->name = name;
+  return hs;
+}
+
+static bool hideset_contains(Hideset *hs, Token *tok)
+{
+  for (; hs; hs = hs->next)
+    if (equal(&tok, hs->name))
+      return true;
+  return false;
+}
+
+static Hideset *hideset_add(Hideset *hs, char *name)
+{
+  Hideset *h = new_hideset(name);
+  h->next = hs;
+  return h;
+}
+
+static Macro *find_macro_name(char *name)
+{
+  for (Macro *m = macros; m; m = m->next)
+    if (!strcmp(m->name, name))
+      return m;
+  return NULL;
+}
+
+static Macro *find_macro(Token *tok)
+{
+  if (tok->kind != TK_IDENT)
+    return NULL;
+  return find_macro_name(tok->str);
+}
+
+static void undef_macro(char *name)
+{
+  for (Macro **m = &macros; *m; m = &(*m)->next)
+  {
+    if (!strcmp((*m)->name, name))
+    {
+      *m = (*m)->next;
+      return;
+    }
+  }
+}
+
+// #define NAME body
+// #define NAME(a, b) body
+static void read_macro_definition(void)
+{
+  Token *tok = read_token();
+  if (tok->at_bol || tok->kind != TK_IDENT)
+    error_tok(&tok, "macro name must be an identifier");
+
+  Macro *m = calloc(1, sizeof(Macro));
+  m->name = tok->str;
+  m->is_objlike = true;
+
+  // A function-like macro has `(` right after its name.
+  tok = peek_token();
+  if (!tok->at_bol && !tok->has_space && equal(&tok, "("))
+  {
+    m->is_objlike = false;
+    read_token();
+    int cap = 4;
+    m->params = calloc(cap, sizeof(char *));
+    for (tok = read_token(); !equal(&tok, ")"); tok = read_token())
+    {
+      if (m->nparams > 0)
+      {
+        if (!equal(&tok, ","))
+          error_tok(&tok, "expected ',' but got '%.*s'", (int)tok->len, tok->str);
+        tok = read_token();
+      }
+      if (tok->at_bol || tok->kind != TK_IDENT)
+        error_tok(&tok, "expected a parameter name");
+      if (m->nparams == cap)
+        m->params = realloc(m->params, sizeof(char *) * (cap *= 2));
+      m->params[m->nparams++] = tok->str;
+    }
+  }
+
+  m->body = copy_line();
+  undef_macro(m->name);
+  m->next = macros;
+  macros = m;
+}
+
+// Reads one macro argument, up to the `,` or `)` at the outer level, and
+// sets `*end` to that token.
+static Token *read_macro_arg(Token **end, Token *start)
+{
+  Token head = {};
+  Token *cur = &head;
+  int depth = 0;
+
+  for (;;)
+  {
+    Token *tok = read_token();
+    if (tok->kind == TK_EOF)
+      error_tok(&start, "unterminated macro call");
+    if (depth == 0 && (equal(&tok, ",") || equal(&tok, ")")))
+    {
+      *end = tok;
+      break;
+    }
+    if (equal(&tok, "("))
+      depth++;
+    else if (equal(&tok, ")"))
+      depth--;
+    cur = cur->next = copy_token(tok);
+  }
+
+  cur->next = new_eof(*end);
+  return head.next;
+}
+
+// If `tok`, just read, is a macro use, puts its expansion in front of the
+// input to be scanned again.
+static bool expand_macro(Token *tok)
+{
+  if (hideset_contains(tok->hideset, tok))
+    return false;
+
+  Macro *m = find_macro(tok);
+  if (!m)
+    return false;
+
+  Hideset *hs = hideset_add(tok->hideset, m->name);
+
+  if (m->is_objlike)
+  {
+    if (m->body->kind == TK_EOF)
+      return true;
+    Token *body = append(m->body, pending);
+    for (Token *t = body; t != pending; t = t->next)
+      t->hideset = hs;
+    body->at_bol = false;
+    body->has_space = tok->has_space;
+    pending = body;
+    return true;
+  }
+
+  // A function-like macro name not followed by `(` is a plain identifier.
+  Token *next = peek_token();
+  if (!equal(&next, "("))
+    return false;
+  Token *name = copy_token(tok);
+  read_token();
+
+  Token **args = calloc(m->nparams ? m->nparams : 1, sizeof(Token *));
+  int nargs = 0;
+  Token *end;
+  if (m->nparams == 0)
+  {
+    end = read_token();
+    if (!equal(&end, ")"))
+      error_tok(&end, "too many arguments to macro %s", m->name);
+  }
+  else
+  {
+    for (;;)
+    {
+      args[nargs++] = read_macro_arg(&end, name);
+      if (equal(&end, ")"))
+        break;
+      if (nargs == m->nparams)
+        error_tok(&end, "too many arguments to macro %s", m->name);
+    }
+    if (nargs < m->nparams)
+      error_tok(&end, "too few arguments to macro %s", m->name);
+  }
+
+  // Substitute the arguments into the body.
+  Token head = {};
+  Token *cur = &head;
+  for (Token *b = m->body; b->kind != TK_EOF; b = b->next)
+  {
+    int i = 0;
+    while (i < m->nparams && !(b->kind == TK_IDENT && equal(&b, m->params[i])))
+      i++;
+
+    if (i == m->nparams)
+    {
+      cur = cur->next = copy_token(b);
+      cur->hideset = hs;
+      continue;
+    }
+
+    for (Token *a = args[i]; a->kind != TK_EOF; a = a->next)
+    {
+      cur = cur->next = copy_token(a);
+      cur->at_bol = false;
+    }
+  }
+  cur->next = pending;
+  free(args);
+
+  if (head.next != pending)
+  {
+    head.next->at_bol = false;
+    head.next->has_space = name->has_space;
+    pending = head.next;
+  }
+  return true;
+}
+
+//
+// #if expressions
+//
+
+static long eval_expr(Token **rest, Token *tok);
+
+static long eval_primary(Token **rest, Token *tok)
+{
+  if (equal(&tok, "("))
+  {
+    long val = eval_expr(&tok, tok->next);
+    expect(&tok, ")");
+    *rest = tok;
+    return val;
+  }
+  if (tok->kind == TK_NUM)
+  {
+    *rest = tok->next;
+    return tok->val;
+  }
+  // Identifiers left after macro expansion evaluate to 0.
+  if (tok->kind != TK_EOF && tok->kind != TK_RESERVED && tok->kind != TK_STR)
+  {
+    *rest = tok->next;
+    return 0;
+  }
+  error_tok(&tok, "invalid expression in #if");
+  return 0;
+}
+
+static long eval_unary(Token **rest, Token *tok)
+{
+  if (equal(&tok, "!"))
+    return !eval_unary(rest, tok->next);
+  if (equal(&tok, "-"))
+    return -eval_unary(rest, tok->next);
+  if (equal(&tok, "+"))
+    return eval_unary(rest, tok->next);
+  return eval_primary(rest, tok);
+}
+
+static long eval_mul(Token **rest, Token *tok)
+{
+  long val = eval_unary(&tok, tok);
+  for (;;)
+  {
+    if (equal(&tok, "*"))
+    {
+      val *= eval_unary(&tok, tok->next);
+      continue;
+    }
+    if (equal(&tok, "/"))
+    {
+      Token *start = tok;
+      long rhs = eval_unary(&tok, tok->next);
+      if (rhs == 0)
+        error_tok(&start, "division by zero in #if");
+      val /= rhs;
+      continue;
+    }
+    *rest = tok;
+    return val;
+  }
+}
+
+static long eval_add(Token **rest, Token *tok)
+{
+  long val = eval_mul(&tok, tok);
+  for (;;)
+  {
+    if (equal(&tok, "+"))
+      val += eval_mul(&tok, tok->next);
+    else if (equal(&tok, "-"))
+      val -= eval_mul(&tok, tok->next);
+    else
+    {
+      *rest = tok;
+      return val;
+    }
+  }
+}
+
+static long eval_relational(Token **rest, Token *tok)
+{
+  long val = eval_add(&tok, tok);
+  for (;;)
+  {
+    if (equal(&tok, "<"))
+      val = val < eval_add(&tok, tok->next);
+    else if (equal(&tok, "<="))
+      val = val <= eval_add(&tok, tok->next);
+    else if (equal(&tok, ">"))
+      val = val > eval_add(&tok, tok->next);
+    else if (equal(&tok, ">="))
+      val = val >= eval_add(&tok, tok->next);
+    else
+    {
+      *rest = tok;
+      return val;
+    }
+  }
+}
+
+static long eval_equality(Token **rest, Token *tok)
+{
+  long val = eval_relational(&tok, tok);
+  for (;;)
+  {
+    if (equal(&tok, "=="))
+      val = val == eval_relational(&tok, tok->next);
+    else if (equal(&tok, "!="))
+      val = val != eval_relational(&tok, tok->next);
+    else
+    {
+      *rest = tok;
+      return val;
+    }
+  }
+}
+
+static long eval_logand(Token **rest, Token *tok)
+{
+  long val = eval_equality(&tok, tok);
+  while (equal(&tok, "&&"))
+  {
+    long rhs = eval_equality(&tok, tok->next);
+    val = val && rhs;
+  }
+  *rest = tok;
+  return val;
+}
+
+static long eval_expr(Token **rest, Token *tok)
+{
+  long val = eval_logand(&tok, tok);
+  while (equal(&tok, "||"))
+  {
+    long rhs = eval_logand(&tok, tok->next);
+    val = val || rhs;
+  }
+  *rest = tok;
+  return val;
+}
+
+static Token *new_num_token(int val, Token *tmpl)
+{
+  Token *t = copy_token(tmpl);
+  t->kind = TK_NUM;
+  t->val = val;
+  t->str = "";
+  t->len = 0;
+  return t;
+}
+
+// Evaluates the rest of an #if or #elif line.
+static long eval_const_expr(Token *start)
+{
+  Token *expr = copy_line();
+
+  // Replace `defined(X)` and `defined X` before expanding macros.
+  Token head = {};
+  Token *cur = &head;
+  for (Token *t = expr; t->kind != TK_EOF;)
+  {
+    if (!equal(&t, "defined") || t->kind != TK_IDENT)
+    {
+      cur = cur->next = t;
+      t = t->next;
+      continue;
+    }
+
+    Token *d = t;
+    t = t->next;
+    bool paren = consume(&t, "(");
+    if (t->kind != TK_IDENT)
+      error_tok(&d, "macro name must be an identifier");
+    cur = cur->next = new_num_token(find_macro(t) != NULL, d);
+    t = t->next;
+    if (paren)
+      expect(&t, ")");
+    cur->next = t;
+  }
+  if (cur == &head)
+    error_tok(&start, "no expression");
+
+  // Expand macros by reading the line as the input. Every token of the line
+  // is still on one line, so no directives are recognized.
+  Token *saved_pending = pending;
+  Token *saved_peeked = peeked;
+  pending = head.next;
+  peeked = NULL;
+
+  Token exp = {};
+  cur = &exp;
+  for (;;)
+  {
+    Token *t = read_token();
+    if (t->kind == TK_EOF)
+    {
+      cur->next = t;
+      break;
+    }
+    if (!expand_macro(t))
+      cur = cur->next = t;
+  }
+
+  pending = saved_pending;
+  peeked = saved_peeked;
+
+  Token *end;
+  long val = eval_expr(&end, exp.next);
+  if (end->kind != TK_EOF)
+    error_tok(&end, "extra token in #if");
+  return val;
+}
+
+//
+// Conditional inclusion
+//
+
+static CondIncl *push_cond_incl(Token *tok, bool included)
+{
+  CondIncl *ci = calloc(1, sizeof(CondIncl));
+  ci->next = cond_incl;
+  ci->tok = tok;
+  ci->included = included;
+  cond_incl = ci;
+  return ci;
+}
+
+static bool is_if_directive(Token *tok)
+{
+  return is_directive(tok, "if") || is_directive(tok, "ifdef") || is_directive(tok, "ifndef");
+}
+
+// If `tok`, just read, is `#`, returns the directive name after it without
+// consuming it.
+static Token *directive_name(Token *tok)
+{
+  if (!is_hash(tok))
+    return NULL;
+  Token *name = peek_token();
+  return name->at_bol ? NULL : name;
+}
+
+static bool is_if_name(Token *name)
+{
+  return equal(&name, "if") || equal(&name, "ifdef") || equal(&name, "ifndef");
+}
+
+// Skips a nested #if group through its #endif.
+static void skip_cond_incl2(void)
+{
+  for (Token *tok = peek_token(); tok->kind != TK_EOF; tok = peek_token())
+  {
+    read_token();
+    Token *name = directive_name(tok);
+    if (!name)
+      continue;
+    if (is_if_name(name))
+    {
+      read_token();
+      skip_cond_incl2();
+      continue;
+    }
+    if (equal(&name, "endif"))
+    {
+      read_token();
+      skip_line();
+      return;
+    }
+  }
+}
+
+// Skips a group whose condition is false, up to the #elif, #else or
+// #endif that ends it, which is left to be read next.
+static void skip_cond_incl(void)
+{
+  for (Token *tok = peek_token(); tok->kind != TK_EOF; tok = peek_token())
+  {
+    read_token();
+    Token *name = directive_name(tok);
+    if (!name)
+      continue;
+    if (is_if_name(name))
+    {
+      read_token();
+      skip_cond_incl2();
+      continue;
+    }
+    if (equal(&name, "elif") || equal(&name, "else") || equal(&name, "endif"))
+    {
+      unread_token(tok);
+      return;
+    }
+  }
+}
+
+//
+// #include
+//
+
+static bool file_exists(char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return false;
+  fclose(fp);
+  return true;
+}
+
+static char *join_path(char *dir, int dirlen, char *name)
+{
+  char *buf = calloc(1, dirlen + strlen(name) + 2);
+  sprintf(buf, "%.*s/%s", dirlen, dir, name);
+  return buf;
+}
+
+// Quoted names are looked up next to the including file first, then in
+// the -I directories; <names> only in the -I directories.
+static char *search_include(Token *tok, bool quoted)
+{
+  char *name = tok->str;
+  if (name[0] == '/')
+    return file_exists(name) ? name : NULL;
+
+  if (quoted)
+  {
+    char *slash = strrchr(tok->file->name, '/');
+    char *path = slash ? join_path(tok->file->name, slash - tok->file->name, name) : name;
+    if (file_exists(path))
+      return path;
+  }
+
+  for (char **dir = include_paths; dir && *dir; dir++)
+  {
+    char *path = join_path(*dir, strlen(*dir), name);
+    if (file_exists(path))
+      return path;
+  }
+  return NULL;
+}
+
+// Returns the guard macro if the whole file is
+//
+//   #ifndef NAME
+//   #define NAME
+//   ...
+//   #endif
+static char *detect_include_guard(Token *tok)
+{
+  if (!is_directive(tok, "ifndef"))
+    return NULL;
+  tok = tok->next->next;
+  if (tok->kind != TK_IDENT)
+    return NULL;
+  char *name = tok->str;
+  tok = next_line(tok);
+
+  if (!is_directive(tok, "define") || !equal(&tok->next->next, name))
+    return NULL;
+
+  int depth = 0;
+  for (; tok->kind != TK_EOF; tok = tok->next)
+  {
+    if (is_if_directive(tok))
+      depth++;
+    else if (is_directive(tok, "endif"))
+    {
+      if (depth == 0)
+        return next_line(tok->next->next)->kind == TK_EOF ? name : NULL;
+      depth--;
+    }
+  }
+  return NULL;
+}
+
+static IncludeFile *read_include(char *path)
+{
+  for (IncludeFile *inc = include_cache; inc; inc = inc->next)
+    if (!strcmp(inc->path, path))
+      return inc;
+
+  IncludeFile *inc = calloc(1, sizeof(IncludeFile));
+  inc->path = path;
+  inc->tokens = tokenize(path, read_file(path));
+  inc->guard = detect_include_guard(inc->tokens);
+  inc->next = include_cache;
+  include_cache = inc;
+  return inc;
+}
+
+// Puts the tokens of the included file in front of the input.
+static void include_file(Token *tok)
+{
+  if (tok->kind != TK_STR || tok->at_bol)
+    error_tok(&tok, "expected a file name");
+
+  char *path = search_include(tok, tok->loc[0] == '"');
+  if (!path)
+    error_tok(&tok, "%s: cannot find include file", tok->str);
+
+  IncludeFile *inc = read_include(path);
+  if (inc->guard && find_macro_name(inc->guard))
+    return;
+  pending = append(inc->tokens, pending);
+}
+
+// Processes the directive after the `#` token `start`.
+static void directive(Token *start)
+{
+  // A lone `#` is a null directive.
+  Token *tok = peek_token();
+  if (tok->at_bol)
+    return;
+  read_token();
+
+  if (equal(&tok, "include"))
+  {
+    Token *name = copy_token(read_token());
+    skip_line();
+    include_file(name);
+    return;
+  }
+
+  if (equal(&tok, "define"))
+  {
+    read_macro_definition();
+    return;
+  }
+
+  if (equal(&tok, "undef"))
+  {
+    tok = read_token();
+    if (tok->at_bol || tok->kind != TK_IDENT)
+      error_tok(&tok, "macro name must be an identifier");
+    undef_macro(tok->str);
+    skip_line();
+    return;
+  }
+
+  if (equal(&tok, "if"))
+  {
+    long val = eval_const_expr(start);
+    push_cond_incl(start, val);
+    if (!val)
+      skip_cond_incl();
+    return;
+  }
+
+  if (equal(&tok, "ifdef") || equal(&tok, "ifndef"))
+  {
+    bool want = equal(&tok, "ifdef");
+    tok = read_token();
+    if (tok->at_bol || tok->kind != TK_IDENT)
+      error_tok(&tok, "macro name must be an identifier");
+    bool defined = find_macro(tok) != NULL;
+    push_cond_incl(start, defined == want);
+    skip_line();
+    if (defined != want)
+      skip_cond_incl();
+    return;
+  }
+
+  if (equal(&tok, "elif"))
+  {
+    if (!cond_incl || cond_incl->in_else)
+      error_tok(&start, "stray #elif");
+    if (!cond_incl->included && eval_const_expr(start))
+      cond_incl->included = true;
+    else
+    {
+      skip_line();
+      skip_cond_incl();
+    }
+    return;
+  }
+
+  if (equal(&tok, "else"))
+  {
+    if (!cond_incl || cond_incl->in_else)
+      error_tok(&start, "stray #else");
+    cond_incl->in_else = true;
+    skip_line();
+    if (cond_incl->included)
+      skip_cond_incl();
+    return;
+  }
+
+  if (equal(&tok, "endif"))
+  {
+    if (!cond_incl)
+      error_tok(&start, "stray #endif");
+    cond_incl = cond_incl->next;
+    skip_line();
+    return;
+  }
+
+  error_tok(&tok, "invalid preprocessor directive");
+}
+
+// Returns the next token of the main file after preprocessing.
+static Token *pp_next(void)
+{
+  for (;;)
+  {
+    Token *tok = read_token();
+    if (tok->kind == TK_EOF)
+    {
+      if (cond_incl)
+        error_tok(&cond_incl->tok, "unterminated conditional directive");
+      return tok;
+    }
+
+    if (expand_macro(tok))
+      continue;
+    if (!is_hash(tok))
+      return tok;
+    directive(copy_token(tok));
+  }
+}
+
+// Preprocesses the main file as the parser reads it and returns the first
+// token.
+Token *preprocess(Lexer *lx)
+{
+  lexer = lx;
+  return token_stream(pp_next);
+}
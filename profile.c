@@ -0,0 +1,140 @@
+#include "9cc.h"
+
+// Profile-guided optimization.
+//
+// With -fprofile-generate every function gets an array of counters:
+//
+//   [0]             calls, including inlined copies
+//   [2s-1], [2s]    how often branch site `s` went to its true and false side
+//
+// where the sites are the if, while and for statements of the function,
+// numbered from 1 by the parser. A constructor hands the arrays to
+// runtime/profile.c, which adds them to the profile file at exit.
+//
+// The file is plain text, one record per function:
+//
+//   fn <name> <nsites> <calls>
+//   <true> <false>          (nsites lines)
+//
+// -fprofile-use reads it back. Records whose site count no longer matches
+// the function are stale and ignored.
+
+typedef struct ProfileFn ProfileFn;
+struct ProfileFn
+{
+  ProfileFn *next;
+  char *name;
+  int nsites;
+  long *counters;
+};
+
+static ProfileFn *profile;
+static long total_calls;
+
+void load_profile(char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char name[256];
+  int nsites;
+  long calls;
+  while (fscanf(fp, " fn %255s %d %ld", name, &nsites, &calls) == 3)
+  {
+    if (nsites < 0)
+      error("%s: malformed profile", path);
+
+    ProfileFn *p = calloc(1, sizeof(ProfileFn));
+    p->name = mystrndup(name, strlen(name));
+    p->nsites = nsites;
+    p->counters = calloc(1 + 2 * nsites, sizeof(long));
+    p->counters[0] = calls;
+    for (int i = 1; i <= 2 * nsites; i++)
+      if (fscanf(fp, "%ld", &p->counters[i]) != 1)
+        error("%s: malformed profile", path);
+
+    p->next = profile;
+    profile = p;
+    total_calls += calls;
+  }
+  if (!feof(fp))
+    error("%s: malformed profile", path);
+  fclose(fp);
+}
+
+static ProfileFn *find_profile(Obj *fn)
+{
+  for (ProfileFn *p = profile; p; p = p->next)
+    if (!strcmp(p->name, fn->name) && p->nsites == fn->nsites)
+      return p;
+  return NULL;
+}
+
+// Returns how often `fn` was called, or -1 if the profile has no record.
+long profile_calls(Obj *fn)
+{
+  ProfileFn *p = find_profile(fn);
+  return p ? p->counters[0] : -1;
+}
+
+// Returns true if `fn` got at least 1% of all calls in the profile.
+bool profile_hot(Obj *fn)
+{
+  long calls = profile_calls(fn);
+  return calls > 0 && calls * 100 >= total_calls;
+}
+
+// Sets how often branch site `site` of `fn` went each way. Returns false
+// if the profile has no record.
+bool profile_branch(Obj *fn, int site, long *taken, long *not_taken)
+{
+  ProfileFn *p = find_profile(fn);
+  if (!p || site < 1 || site > p->nsites)
+    return false;
+  *taken = p->counters[2 * site - 1];
+  *not_taken = p->counters[2 * site];
+  return true;
+}
+
+// Emits the counter arrays of -fprofile-generate and a constructor that
+// registers them with the runtime.
+void emit_profile_counters(Obj *prog)
+{
+  int nfns = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function)
+      continue;
+    printf("  .bss\n");
+    printf("  .align 8\n");
+    printf(".L.prof.%s:\n", fn->name);
+    printf("  .zero %d\n", 8 * (1 + 2 * fn->nsites));
+    printf("  .section .rodata\n");
+    printf(".L.prof.name.%s:\n", fn->name);
+    printf("  .string \"%s\"\n", fn->name);
+    nfns++;
+  }
+
+  // struct { char *name; long nsites; long *counters; } fns[nfns];
+  printf("  .data\n");
+  printf("  .align 8\n");
+  printf(".L.prof.fns:\n");
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function)
+      continue;
+    printf("  .quad .L.prof.name.%s\n", fn->name);
+    printf("  .quad %d\n", fn->nsites);
+    printf("  .quad .L.prof.%s\n", fn->name);
+  }
+
+  printf("  .text\n");
+  printf(".L.prof.init:\n");
+  printf("  lea rdi, .L.prof.fns[rip]\n");
+  printf("  mov rsi, %d\n", nfns);
+  printf("  jmp __9cc_profile_register\n");
+  printf("  .section .init_array,\"aw\"\n");
+  printf("  .align 8\n");
+  printf("  .quad .L.prof.init\n");
+}
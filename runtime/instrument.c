@@ -0,0 +1,224 @@
+// Runtime for programs compiled by 9cc with -finstrument-functions.
+//
+// Link it with the program:
+//
+//   ./9cc -finstrument-functions prog.c > prog.s
+//   cc -o prog prog.s runtime/instrument.c
+//
+// Every call is timed with rdtsc. At exit two files are written, named
+// after $NINECC_INSTRUMENT (default "9cc-instrument"):
+//
+//   <name>.flat    calls and inclusive and exclusive cycles per function
+//   <name>.folded  one "main;f;g <cycles>" line per call stack, with the
+//                  cycles spent in the last function itself; this is the
+//                  input format of flamegraph.pl
+//
+// Time of recursive calls is counted once in the inclusive total.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Func Func;
+struct Func
+{
+  Func *next;
+  const char *name;
+  uint64_t calls;
+  uint64_t inclusive;
+  uint64_t exclusive;
+  int active; // Frames of this function on the stack
+};
+
+// Per-function record emitted by the compiler; `func` caches the lookup.
+typedef struct
+{
+  const char *name;
+  Func *func;
+} Site;
+
+// Node of the calling context tree: one per distinct call stack.
+typedef struct CallNode CallNode;
+struct CallNode
+{
+  Func *func;
+  CallNode *parent;
+  CallNode *child;
+  CallNode *sibling;
+  uint64_t self;
+};
+
+typedef struct
+{
+  CallNode *node;
+  uint64_t start;
+  uint64_t children; // Cycles spent in callees
+} Frame;
+
+static Func *funcs;
+static CallNode root;
+static Frame *stack;
+static int depth;
+static int stack_cap;
+
+static inline uint64_t rdtsc(void)
+{
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (uint64_t)hi << 32 | lo;
+}
+
+static void dump(void);
+
+static CallNode *child_node(CallNode *parent, Func *func)
+{
+  for (CallNode *n = parent->child; n; n = n->sibling)
+    if (n->func == func)
+      return n;
+
+  CallNode *n = calloc(1, sizeof(CallNode));
+  n->func = func;
+  n->parent = parent;
+  n->sibling = parent->child;
+  parent->child = n;
+  return n;
+}
+
+void __9cc_func_enter(Site *site)
+{
+  if (!site->func)
+  {
+    if (!funcs)
+      atexit(dump);
+    Func *f = calloc(1, sizeof(Func));
+    f->name = site->name;
+    f->next = funcs;
+    funcs = f;
+    site->func = f;
+  }
+
+  if (depth == stack_cap)
+  {
+    stack_cap = stack_cap ? stack_cap * 2 : 256;
+    stack = realloc(stack, sizeof(Frame) * stack_cap);
+  }
+
+  Func *f = site->func;
+  f->calls++;
+  f->active++;
+  Frame *fr = &stack[depth];
+  fr->node = child_node(depth ? stack[depth - 1].node : &root, f);
+  fr->children = 0;
+  depth++;
+  fr->start = rdtsc();
+}
+
+static void leave(uint64_t now)
+{
+  Frame *fr = &stack[--depth];
+  uint64_t elapsed = now - fr->start;
+  uint64_t self = elapsed - fr->children;
+
+  Func *f = fr->node->func;
+  f->exclusive += self;
+  if (--f->active == 0)
+    f->inclusive += elapsed;
+  fr->node->self += self;
+
+  if (depth)
+    stack[depth - 1].children += elapsed;
+}
+
+void __9cc_func_exit(void)
+{
+  uint64_t now = rdtsc();
+  if (depth)
+    leave(now);
+}
+
+static int by_exclusive(const void *a, const void *b)
+{
+  Func *x = *(Func **)a;
+  Func *y = *(Func **)b;
+  return x->exclusive < y->exclusive ? 1 : x->exclusive > y->exclusive ? -1 : 0;
+}
+
+static void write_folded(FILE *fp, CallNode *node, char *path, size_t len)
+{
+  for (CallNode *n = node->child; n; n = n->sibling)
+  {
+    size_t name_len = strlen(n->func->name);
+    char *p = malloc(len + name_len + 2);
+    memcpy(p, path, len);
+    size_t plen = len;
+    if (plen)
+      p[plen++] = ';';
+    memcpy(p + plen, n->func->name, name_len);
+    plen += name_len;
+
+    if (n->self)
+      fprintf(fp, "%.*s %llu\n", (int)plen, p, (unsigned long long)n->self);
+    write_folded(fp, n, p, plen);
+    free(p);
+  }
+}
+
+static FILE *open_output(char *suffix)
+{
+  char *base = getenv("NINECC_INSTRUMENT");
+  if (!base)
+    base = "9cc-instrument";
+  char *path = malloc(strlen(base) + strlen(suffix) + 1);
+  strcpy(path, base);
+  strcat(path, suffix);
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    perror(path);
+  free(path);
+  return fp;
+}
+
+static void dump(void)
+{
+  // exit() may be called with functions still running.
+  uint64_t now = rdtsc();
+  while (depth)
+    leave(now);
+
+  int n = 0;
+  uint64_t total = 0;
+  for (Func *f = funcs; f; f = f->next)
+  {
+    n++;
+    total += f->exclusive;
+  }
+
+  Func **sorted = malloc(sizeof(Func *) * (n ? n : 1));
+  n = 0;
+  for (Func *f = funcs; f; f = f->next)
+    sorted[n++] = f;
+  qsort(sorted, n, sizeof(Func *), by_exclusive);
+
+  FILE *fp = open_output(".flat");
+  if (fp)
+  {
+    fprintf(fp, "%6s %12s %16s %16s  %s\n", "self%", "calls", "self cycles", "total cycles", "name");
+    for (int i = 0; i < n; i++)
+    {
+      Func *f = sorted[i];
+      fprintf(fp, "%6.2f %12llu %16llu %16llu  %s\n",
+              total ? 100.0 * f->exclusive / total : 0.0, (unsigned long long)f->calls,
+              (unsigned long long)f->exclusive, (unsigned long long)f->inclusive, f->name);
+    }
+    fclose(fp);
+  }
+  free(sorted);
+
+  fp = open_output(".folded");
+  if (fp)
+  {
+    write_folded(fp, &root, "", 0);
+    fclose(fp);
+  }
+}
@@ -0,0 +1,130 @@
+// Runtime for programs compiled by 9cc with -fprofile-generate.
+//
+// Link it with the program:
+//
+//   ./9cc -fprofile-generate prog.c > prog.s
+//   cc -o prog prog.s runtime/profile.c
+//
+// At exit the counters are added to the profile file, 9cc.prof or the path
+// in $NINECC_PROFILE, so several runs accumulate. Build with -fprofile-use
+// to read it back.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Must match emit_profile_counters() in profile.c.
+typedef struct
+{
+  char *name;
+  long nsites;
+  long *counters; // 1 + 2 * nsites
+} ProfFn;
+
+typedef struct Module Module;
+struct Module
+{
+  Module *next;
+  ProfFn *fns;
+  long nfns;
+};
+
+static Module *modules;
+
+// Records read back from an existing profile file.
+typedef struct Record Record;
+struct Record
+{
+  Record *next;
+  char name[256];
+  long nsites;
+  long *counters;
+  int merged;
+};
+
+static Record *read_records(FILE *fp)
+{
+  Record *list = NULL;
+  for (;;)
+  {
+    Record *r = calloc(1, sizeof(Record));
+    long calls;
+    if (fscanf(fp, " fn %255s %ld %ld", r->name, &r->nsites, &calls) != 3 || r->nsites < 0)
+    {
+      free(r);
+      return list;
+    }
+    r->counters = calloc(1 + 2 * r->nsites, sizeof(long));
+    r->counters[0] = calls;
+    for (long i = 1; i <= 2 * r->nsites; i++)
+      if (fscanf(fp, "%ld", &r->counters[i]) != 1)
+        return list;
+    r->next = list;
+    list = r;
+  }
+}
+
+static void write_record(FILE *fp, char *name, long nsites, long *counters)
+{
+  fprintf(fp, "fn %s %ld %ld\n", name, nsites, counters[0]);
+  for (long i = 1; i <= nsites; i++)
+    fprintf(fp, "%ld %ld\n", counters[2 * i - 1], counters[2 * i]);
+}
+
+static void dump_profile(void)
+{
+  char *path = getenv("NINECC_PROFILE");
+  if (!path)
+    path = "9cc.prof";
+
+  Record *old = NULL;
+  FILE *fp = fopen(path, "r");
+  if (fp)
+  {
+    old = read_records(fp);
+    fclose(fp);
+  }
+
+  fp = fopen(path, "w");
+  if (!fp)
+  {
+    perror(path);
+    return;
+  }
+
+  for (Module *m = modules; m; m = m->next)
+  {
+    for (long i = 0; i < m->nfns; i++)
+    {
+      ProfFn *fn = &m->fns[i];
+      for (Record *r = old; r; r = r->next)
+      {
+        if (r->merged || r->nsites != fn->nsites || strcmp(r->name, fn->name))
+          continue;
+        for (long j = 0; j <= 2 * fn->nsites; j++)
+          fn->counters[j] += r->counters[j];
+        r->merged = 1;
+        break;
+      }
+      write_record(fp, fn->name, fn->nsites, fn->counters);
+    }
+  }
+
+  // Keep what other programs recorded.
+  for (Record *r = old; r; r = r->next)
+    if (!r->merged)
+      write_record(fp, r->name, r->nsites, r->counters);
+  fclose(fp);
+}
+
+void __9cc_profile_register(ProfFn *fns, long nfns)
+{
+  if (!modules)
+    atexit(dump_profile);
+
+  Module *m = calloc(1, sizeof(Module));
+  m->fns = fns;
+  m->nfns = nfns;
+  m->next = modules;
+  modules = m;
+}
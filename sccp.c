@@ -0,0 +1,742 @@
+#include "9cc.h"
+#include <stdint.h>
+
+// Sparse conditional constant and copy propagation.
+//
+// Every local that is never address-taken gets a lattice value per program
+// point: not yet assigned, a constant, a copy of another such local, or
+// unknown. Statements are walked in execution order, joining the values
+// where control flow merges and iterating loops until their head no longer
+// changes. A branch whose condition turns out constant only passes its
+// values down the side that runs, so a variable assigned differently on a
+// dead path still counts as constant.
+//
+// Once the values are known, uses of constant variables become numbers,
+// copies read the original, expressions of constants are folded, and if
+// statements and loops whose condition is constant lose the code that
+// never runs.
+
+enum
+{
+  LAT_UNDEF, // No assignment reaches here yet
+  LAT_CONST,
+  LAT_COPY,  // Same value as local number `val`
+  LAT_OVER,  // Unknown
+};
+
+typedef struct
+{
+  int kind;
+  int val;
+} Lattice;
+
+typedef struct
+{
+  bool reachable;
+  Lattice *vars;
+} Env;
+
+// Tracked locals by number, and a hash from Obj to number.
+static Obj **vars;
+static int nvars;
+static Obj **slots;
+static int *slot_ids;
+static int nslots;
+
+static Obj *current_fn;
+static Env cur;
+static int nchanges;
+
+// Where `break` and the `return` of an inlined body go.
+#define MAX_DEPTH 256
+static Env *break_envs[MAX_DEPTH];
+static int nbreaks;
+static Env *return_envs[MAX_DEPTH];
+static int nreturns;
+static Env *switch_env; // Values at the start of the innermost switch
+
+static void push_env(Env **stack, int *depth, Env *env)
+{
+  if (*depth == MAX_DEPTH)
+    error("%s: statements nested too deeply", current_fn->name);
+  stack[(*depth)++] = env;
+}
+
+static size_t hash_obj(Obj *var)
+{
+  uintptr_t x = (uintptr_t)var;
+  return (x >> 4) ^ (x >> 13);
+}
+
+static int var_id(Obj *var)
+{
+  if (!nslots)
+    return -1;
+  for (size_t i = hash_obj(var) & (nslots - 1);; i = (i + 1) & (nslots - 1))
+  {
+    if (slots[i] == var)
+      return slot_ids[i];
+    if (!slots[i])
+      return -1;
+  }
+}
+
+static bool is_tracked_type(Type *ty)
+{
+  return ty->tkey == INT || ty->tkey == CHAR || ty->tkey == PTR;
+}
+
+// Numbers the locals of `fn` that are never address-taken.
+static void collect_vars(Obj *fn)
+{
+  nvars = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+    if (!var->addr_taken && is_tracked_type(var->ty))
+      nvars++;
+
+  free(vars);
+  free(slots);
+  free(slot_ids);
+  vars = calloc(nvars ? nvars : 1, sizeof(Obj *));
+  nslots = 1;
+  while (nslots < nvars * 2)
+    nslots *= 2;
+  slots = calloc(nslots, sizeof(Obj *));
+  slot_ids = calloc(nslots, sizeof(int));
+
+  int n = 0;
+  for (Obj *var = *fn->locals; var->next; var = var->next)
+  {
+    if (var->addr_taken || !is_tracked_type(var->ty))
+      continue;
+    size_t i = hash_obj(var) & (nslots - 1);
+    while (slots[i])
+      i = (i + 1) & (nslots - 1);
+    slots[i] = var;
+    slot_ids[i] = n;
+    vars[n++] = var;
+  }
+}
+
+//
+// Environments
+//
+
+static Env *new_env(bool reachable)
+{
+  Env *env = calloc(1, sizeof(Env));
+  env->reachable = reachable;
+  env->vars = calloc(nvars ? nvars : 1, sizeof(Lattice));
+  return env;
+}
+
+static void free_env(Env *env)
+{
+  free(env->vars);
+  free(env);
+}
+
+static void copy_env(Env *dst, Env *src)
+{
+  dst->reachable = src->reachable;
+  memcpy(dst->vars, src->vars, sizeof(Lattice) * nvars);
+}
+
+static Env *clone_env(Env *src)
+{
+  Env *env = new_env(src->reachable);
+  copy_env(env, src);
+  return env;
+}
+
+static bool same_env(Env *a, Env *b)
+{
+  if (a->reachable != b->reachable)
+    return false;
+  for (int i = 0; i < nvars; i++)
+    if (a->vars[i].kind != b->vars[i].kind || a->vars[i].val != b->vars[i].val)
+      return false;
+  return true;
+}
+
+// Merges the values of `src` into `dst` at a join point.
+static void meet(Env *dst, Env *src)
+{
+  if (!src->reachable)
+    return;
+  if (!dst->reachable)
+  {
+    copy_env(dst, src);
+    return;
+  }
+
+  for (int i = 0; i < nvars; i++)
+  {
+    Lattice *a = &dst->vars[i];
+    Lattice *b = &src->vars[i];
+    if (b->kind == LAT_UNDEF || (a->kind == b->kind && a->val == b->val))
+      continue;
+    if (a->kind == LAT_UNDEF)
+      *a = *b;
+    else
+      a->kind = LAT_OVER;
+  }
+}
+
+// Sets local number `id` and forgets copies of its old value.
+static void set_var(int id, Lattice val)
+{
+  for (int i = 0; i < nvars; i++)
+    if (cur.vars[i].kind == LAT_COPY && cur.vars[i].val == id)
+      cur.vars[i].kind = LAT_OVER;
+  cur.vars[id] = val;
+}
+
+static void set_over(Obj *var)
+{
+  int id = var_id(var);
+  if (id >= 0)
+    set_var(id, (Lattice){.kind = LAT_OVER});
+}
+
+//
+// Expressions
+//
+
+static void visit_stmt(Node **slot, bool rewrite);
+static void visit_expr(Node **slot, bool rewrite);
+
+static bool fits_type(Type *ty, int val)
+{
+  return ty->tkey != CHAR || (val >= -128 && val <= 127);
+}
+
+// Returns true and sets `*val` if `node` has a known constant value.
+static bool eval(Node *node, int *val)
+{
+  int l, r;
+  switch (node->kind)
+  {
+  case ND_NUM:
+    *val = node->val;
+    return true;
+  case ND_VAR:
+  {
+    int id = var_id(node->var);
+    if (id < 0 || !cur.reachable)
+      return false;
+    Lattice *lat = &cur.vars[id];
+    if (lat->kind == LAT_COPY)
+      lat = &cur.vars[lat->val];
+    if (lat->kind != LAT_CONST)
+      return false;
+    *val = lat->val;
+    return true;
+  }
+  case ND_NEG:
+    if (!eval(node->lhs, &l))
+      return false;
+    *val = -(unsigned)l;
+    return true;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    // Pointer arithmetic and comparisons are left alone.
+    if (!node->lhs->ty || !node->rhs->ty || node->lhs->ty->ptr_to || node->rhs->ty->ptr_to)
+      return false;
+    if (!eval(node->lhs, &l) || !eval(node->rhs, &r))
+      return false;
+    break;
+  default:
+    return false;
+  }
+
+  switch (node->kind)
+  {
+  case ND_ADD:
+    *val = (unsigned)l + r;
+    return true;
+  case ND_SUB:
+    *val = (unsigned)l - r;
+    return true;
+  case ND_MUL:
+    *val = (unsigned)l * r;
+    return true;
+  case ND_DIV:
+    // Division that traps stays for the program to run.
+    if (r == 0 || (l == -2147483647 - 1 && r == -1))
+      return false;
+    *val = l / r;
+    return true;
+  case ND_EQ:
+    *val = l == r;
+    return true;
+  case ND_NE:
+    *val = l != r;
+    return true;
+  case ND_LT:
+    *val = l < r;
+    return true;
+  default:
+    *val = l <= r;
+    return true;
+  }
+}
+
+static Node *new_const(int val)
+{
+  Node *node = new_num(val);
+  node->ty = ty_int;
+  return node;
+}
+
+static bool same_type(Type *a, Type *b)
+{
+  if (a->tkey != b->tkey || a->size != b->size)
+    return false;
+  return a->tkey != PTR || same_type(a->ptr_to, b->ptr_to);
+}
+
+// Returns the lattice value of `node` assigned to a variable of type `ty`.
+static Lattice lattice_of(Node *node, Type *ty)
+{
+  int val;
+  if (ty->tkey != PTR && eval(node, &val))
+  {
+    if (ty->tkey == CHAR)
+      val = (signed char)val;
+    return (Lattice){.kind = LAT_CONST, .val = val};
+  }
+
+  if (node->kind == ND_VAR && same_type(node->var->ty, ty))
+  {
+    int id = var_id(node->var);
+    if (id >= 0)
+    {
+      Lattice *src = &cur.vars[id];
+      if (src->kind == LAT_COPY)
+        return *src;
+      if (src->kind != LAT_UNDEF)
+        return (Lattice){.kind = LAT_COPY, .val = id};
+    }
+  }
+  return (Lattice){.kind = LAT_OVER};
+}
+
+// Replaces a use of a variable by its constant or the local it copies.
+static void rewrite_var(Node **slot)
+{
+  int id = var_id((*slot)->var);
+  if (id < 0)
+    return;
+
+  Lattice *lat = &cur.vars[id];
+  if (lat->kind == LAT_CONST && fits_type((*slot)->ty, lat->val))
+  {
+    *slot = new_const(lat->val);
+    nchanges++;
+  }
+  else if (lat->kind == LAT_COPY)
+  {
+    *slot = new_var_node(vars[lat->val]);
+    nchanges++;
+  }
+}
+
+// Folds arithmetic on constants at `slot`.
+static void fold(Node **slot)
+{
+  Node *node = *slot;
+  int val;
+  if (node->kind == ND_NUM || node->kind == ND_VAR || !eval(node, &val))
+    return;
+  *slot = new_const(val);
+  nchanges++;
+}
+
+// Sets the variables that `node` assigns anywhere but at its top to
+// unknown, as the order they change in is not tied down.
+static void kill_nested(Node *node, bool top)
+{
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_SIZEOF:
+  case ND_INLINE:
+    return;
+  case ND_FUNCALL:
+    for (Node *arg = node->args; arg; arg = arg->next)
+      kill_nested(arg, false);
+    return;
+  case ND_ASSIGN:
+    if (!top && node->lhs->kind == ND_VAR)
+      set_over(node->lhs->var);
+    // fallthrough
+  default:
+    kill_nested(node->lhs, false);
+    kill_nested(node->rhs, false);
+  }
+}
+
+// Walks the expression at `slot` in evaluation order, updating the
+// current values and, with `rewrite`, replacing what is known.
+static void visit_expr(Node **slot, bool rewrite)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NUM:
+  case ND_SIZEOF:
+    return;
+  case ND_VAR:
+    if (rewrite)
+      rewrite_var(slot);
+    return;
+  case ND_ASSIGN:
+  {
+    Node *lhs = node->lhs;
+    if (lhs->kind == ND_DEREF)
+      visit_expr(&lhs->lhs, rewrite);
+    visit_expr(&node->rhs, rewrite);
+    if (lhs->kind != ND_VAR)
+      return;
+    int id = var_id(lhs->var);
+    if (id >= 0)
+      set_var(id, lattice_of(node->rhs, lhs->var->ty));
+    return;
+  }
+  case ND_ADDR:
+    if (node->lhs->kind == ND_DEREF)
+      visit_expr(&node->lhs->lhs, rewrite);
+    return;
+  case ND_FUNCALL:
+    for (Node **arg = &node->args; *arg; arg = &(*arg)->next)
+    {
+      Node *next = (*arg)->next;
+      visit_expr(arg, rewrite);
+      (*arg)->next = next;
+    }
+    return;
+  case ND_INLINE:
+  {
+    // `return` in the inlined body goes to its end.
+    Env *ret = new_env(false);
+    push_env(return_envs, &nreturns, ret);
+    for (int i = 0; i < node->block_count; i++)
+      visit_stmt(&node->block[i], rewrite);
+    nreturns--;
+    meet(ret, &cur);
+    copy_env(&cur, ret);
+    free_env(ret);
+    return;
+  }
+  case ND_VECLOOP:
+    set_over(node->vec->index);
+    if (node->vec->acc)
+      set_over(node->vec->acc);
+    return;
+  default:
+    visit_expr(&node->lhs, rewrite);
+    visit_expr(&node->rhs, rewrite);
+    if (rewrite)
+      fold(slot);
+  }
+}
+
+// Handles an expression evaluated for its effect or as a condition.
+static void visit_expr_stmt(Node **slot, bool rewrite)
+{
+  if (!*slot)
+    return;
+  kill_nested(*slot, true);
+  visit_expr(slot, rewrite);
+}
+
+//
+// Statements
+//
+
+// Returns true if `node` has a case label of an enclosing switch, which
+// makes it reachable from elsewhere.
+static bool has_case(Node *node)
+{
+  if (!node)
+    return false;
+
+  switch (node->kind)
+  {
+  case ND_CASE:
+    return true;
+  case ND_SWITCH:
+    return false;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      if (has_case(node->block[i]))
+        return true;
+    return false;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_WHILE:
+  case ND_FOR:
+    return has_case(node->then) || has_case(node->els);
+  default:
+    return false;
+  }
+}
+
+// Returns true if the switch body `node` has a default label.
+static bool has_default(Node *node)
+{
+  if (!node)
+    return false;
+
+  switch (node->kind)
+  {
+  case ND_CASE:
+    return !node->cond || has_default(node->then);
+  case ND_SWITCH:
+    return false;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      if (has_default(node->block[i]))
+        return true;
+    return false;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_WHILE:
+  case ND_FOR:
+    return has_default(node->then) || has_default(node->els);
+  default:
+    return false;
+  }
+}
+
+// Returns true and sets `*val` if condition `cond` is known.
+static bool eval_cond(Node *cond, int *val)
+{
+  if (!cond)
+  {
+    *val = 1;
+    return true;
+  }
+  return eval(cond, val);
+}
+
+static void visit_if(Node **slot, bool rewrite)
+{
+  Node *node = *slot;
+  visit_expr_stmt(&node->cond, rewrite);
+
+  int val;
+  if (eval_cond(node->cond, &val))
+  {
+    // Only one side runs.
+    Node **live = val ? &node->then : &node->els;
+    Node *dead = val ? node->els : node->then;
+    visit_stmt(live, rewrite);
+    if (rewrite && !has_case(dead))
+    {
+      *slot = *live ? *live : new_node(ND_NONE);
+      nchanges++;
+    }
+    return;
+  }
+
+  Env *els = clone_env(&cur);
+  visit_stmt(&node->then, rewrite);
+  Env *then = clone_env(&cur);
+  copy_env(&cur, els);
+  visit_stmt(&node->els, rewrite);
+  meet(&cur, then);
+  free_env(then);
+  free_env(els);
+}
+
+// Runs one iteration of the loop `node` from the values in `cur`. Leaves
+// the values at the back edge in `cur` and joins those at the exit into
+// `exit`.
+static void visit_loop_body(Node *node, Env *exit, bool rewrite)
+{
+  push_env(break_envs, &nbreaks, exit);
+  visit_expr_stmt(&node->cond, rewrite);
+
+  int val;
+  bool known = eval_cond(node->cond, &val);
+  if (!known || !val)
+    meet(exit, &cur);
+  if (known && !val)
+    cur.reachable = false;
+
+  visit_stmt(&node->then, rewrite);
+  if (cur.reachable)
+    visit_expr_stmt(&node->inc, rewrite);
+  nbreaks--;
+}
+
+static void visit_loop(Node **slot, bool rewrite)
+{
+  Node *node = *slot;
+  if (node->init)
+    visit_expr_stmt(&node->init, rewrite);
+
+  // Iterate until the values at the loop head are stable; each variable
+  // can only move from undefined to constant or copy to unknown.
+  Env *entry = clone_env(&cur);
+  Env *head = clone_env(&cur);
+  Env *exit = new_env(false);
+  for (;;)
+  {
+    copy_env(&cur, head);
+    exit->reachable = false;
+    visit_loop_body(node, exit, false);
+    meet(&cur, entry);
+    if (same_env(&cur, head))
+      break;
+    copy_env(head, &cur);
+  }
+
+  if (rewrite)
+  {
+    copy_env(&cur, head);
+    exit->reachable = false;
+
+    int val;
+    if (node->cond && eval(node->cond, &val) && !val && !has_case(node->then))
+    {
+      // The body never runs.
+      *slot = node->init ? node->init : new_node(ND_NONE);
+      nchanges++;
+      meet(exit, &cur);
+    }
+    else
+    {
+      visit_loop_body(node, exit, true);
+    }
+  }
+
+  copy_env(&cur, exit);
+  free_env(entry);
+  free_env(head);
+  free_env(exit);
+}
+
+static void visit_switch(Node *node, bool rewrite)
+{
+  visit_expr_stmt(&node->cond, rewrite);
+
+  Env *start = clone_env(&cur);
+  Env *exit = new_env(false);
+  if (!has_default(node->then))
+    meet(exit, &cur);
+
+  // Case labels are reached from the switch with the values at its start.
+  push_env(break_envs, &nbreaks, exit);
+  Env *outer = switch_env;
+  switch_env = start;
+  cur.reachable = false;
+  visit_stmt(&node->then, rewrite);
+  switch_env = outer;
+  nbreaks--;
+
+  meet(exit, &cur);
+  copy_env(&cur, exit);
+  free_env(start);
+  free_env(exit);
+}
+
+static void visit_stmt(Node **slot, bool rewrite)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+  if (!cur.reachable && !has_case(node))
+    return;
+
+  switch (node->kind)
+  {
+  case ND_NONE:
+    return;
+  case ND_BREAK:
+    meet(break_envs[nbreaks - 1], &cur);
+    cur.reachable = false;
+    return;
+  case ND_BLOCK:
+    for (int i = 0; i < node->block_count; i++)
+      visit_stmt(&node->block[i], rewrite);
+    return;
+  case ND_RETURN:
+    visit_expr_stmt(&node->lhs, rewrite);
+    if (nreturns)
+      meet(return_envs[nreturns - 1], &cur);
+    cur.reachable = false;
+    return;
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+    visit_if(slot, rewrite);
+    return;
+  case ND_WHILE:
+  case ND_FOR:
+    visit_loop(slot, rewrite);
+    return;
+  case ND_SWITCH:
+    visit_switch(node, rewrite);
+    return;
+  case ND_CASE:
+    meet(&cur, switch_env);
+    visit_stmt(&node->then, rewrite);
+    return;
+  case ND_VAR:
+    // A declaration stays as it is.
+    return;
+  default:
+    visit_expr_stmt(slot, rewrite);
+  }
+}
+
+// Propagates constants and copies through every function. Returns the
+// number of uses, expressions and statements replaced.
+int propagate_constants(Obj *prog)
+{
+  nchanges = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function || !fn->body)
+      continue;
+
+    analyze_lvars(fn);
+    collect_vars(fn);
+    current_fn = fn;
+
+    Env *env = new_env(true);
+    cur = *env;
+    for (Obj *var = fn->params; var->next; var = var->next)
+      set_over(var);
+
+    int before = nchanges;
+    for (int i = 0; i < fn->stmt_count; i++)
+      visit_stmt(&fn->body[i], true);
+    free(env->vars);
+    free(env);
+
+    int n = nchanges - before;
+    if (opt_info && n)
+      fprintf(stderr, "%s: propagated constants and copies into %d place%s\n", fn->name, n,
+              n == 1 ? "" : "s");
+  }
+  return nchanges;
+}
@@ -9,6 +9,14 @@ add6(a, b, c, d, e, f) {
   return a+b+c+d+e+f;
 }
 
+add8(a, b, c, d, e, f, g, h) {
+  return a+2*b+3*c+4*d+5*e+6*f+7*g+8*h;
+}
+
+int stack_aligned() {
+  return (long)__builtin_frame_address(0) % 16 == 0;
+}
+
 void alloc4(int **p, int w, int x, int y, int z) {
   *p = (int*)malloc(4 * sizeof(int));
   (*p)[0] = w;
@@ -18,20 +26,51 @@ void alloc4(int **p, int w, int x, int y, int z) {
 }
 EOF
 
+cat <<EOF > tmp.h
+#ifndef TMP_H
+#define TMP_H
+#define SQ(x) ((x) * (x))
+int three() { return 3; }
+#endif
+EOF
+
+# assert expected input [compiler flags...]
+#
+# Each test also runs at -O0, so the unoptimized code paths stay covered
+# now that the default level runs every pass. Flags given to the test come
+# after it and still win.
 assert() {
   expected="$1"
   input="$2"
+  shift 2
+
+  for opt in -O0 ""; do
+    echo "$input" | ./9cc $opt "$@" - > tmp.s || error "$input"
+    cc -static -o tmp tmp.s tmp2.o
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" = "$expected" ]; then
+      echo "$input => $actual ${opt:-default}"
+    else
+      echo "$input => $expected expected, but got $actual ${opt:-default}"
+      error "$input"
+    fi
+  done
+}
 
-  echo "$input" | ./9cc - > tmp.s || error "$input" 
-  cc -static -o tmp tmp.s tmp2.o
-  ./tmp
-  actual="$?"
+# Expects compiling `input` to fail with `expected` diagnostics.
+assert_errors() {
+  expected="$1"
+  input="$2"
+
+  actual=$(echo "$input" | ./9cc - 2>&1 >/dev/null | grep -c '\^ ')
 
   if [ "$actual" = "$expected" ]; then
-    echo "$input => $actual"
+    echo "$input => $actual errors"
   else
-    echo "$input => $expected expected, but got $actual"
-    error "$input"
+    echo "$input => $expected errors expected, but got $actual"
+    exit 1
   fi
 }
 
@@ -239,5 +278,163 @@ assert 99 'int main() { return "abc"[2]; }'
 assert 0 'int main() { return "abc"[3]; }'
 assert 4 'int main() { return sizeof("abc"); }'
 
+assert 9 'int main() { int a; a=0; { a=a+1; a=a+1; a=a+1; a=a+1; a=a+1; a=a+1; a=a+1; a=a+1; a=a+1; } return a; }'
+
+assert 8 'int main() { int a; a=3; int b; b=a+1; int c; c=b*2; return c; }'
+assert 27 'int main() { int s; s=0; int i; for (i=0; i<5; i=i+1) { int t; t=i*2; s=s+t; } int u; u=7; return s+u; }'
+assert 8 'int main() { int x; int *p; p=&x; int y; y=5; *p=3; return x+y; }'
+assert 9 'int main() { int a[3]; int *p; p=a; int b; b=4; p[2]=5; return a[2]+b; }'
+assert 6 'int main() { char c; c=1; int *p; int x; x=5; p=&x; return *p+c; }'
+
+assert 19 'int max(int a, int b) { if (a < b) return b; return a; } int add2(int x, int y) { return x+y; } int main() { int i; int m; m=0; for (i=0; i<10; i=i+1) { m = max(m, add2(i, 3)); } return m + add2(1, 6); }'
+assert 9 'int main() { int x; x=4; return dbl(x) + one(); } int dbl(int x) { int y; y = x; return y + x; } int one() { return 1; }'
+assert 1 'int main() { return sub_char2(7, 3, 3); } int sub_char2(char a, char b, char c) { return a-b-c; }'
+assert 5 'int main() { int a[2]; a[1]=5; return get1(a); } int get1(int *p) { return p[1]; }'
+
+assert 128 'int main() { return loop(10000000, 0); } int loop(int n, int acc) { if (n==0) return acc; return loop(n-1, acc+1); }'
+assert 0 'int main() { return even(1000001); } int even(int n) { if (n==0) return 1; return odd(n-1); } int odd(int n) { if (n==0) return 0; return even(n-1); }'
+assert 10 'int main() { return f(4, 0); } int f(int n, int s) { int x; x = s + n; if (n==0) return s; return g(&x, n); } int g(int *p, int n) { return f(n-1, *p); }'
+
+assert 119 'int g; int main() { int a[10]; int n; int k; int s; int i; int *p; n=5; k=2; g=3; s=0; p=a; for (i=0; i<n*2; i=i+1) { a[i] = i*(k+g); } i=0; while (i<n*2) { s = s+p[i]+a[k+1]; i=i+1; } return s; }'
+assert 12 'int g; int bump() { g = g + 1; return 0; } int main() { int s; int i; s=0; g=0; for (i=0; i<4; i=i+1) { s = s + g*2; bump(); } return s; }'
+assert 20 'int main() { int x; int *p; int s; int i; p=&x; x=1; s=0; for (i=0; i<4; i=i+1) { s = s + x*2; *p = *p + 1; } return s; }'
+assert 6 'int main() { int n; int s; int i; n=0; s=0; for (i=0; i<0; i=i+1) { s = s + 6/n; } return s + 6; }'
+
+assert 0 'int main() { int x; x=256; if (x!=256) return 1; return 0; }'
+assert 1 'int main() { int x; x=256; if (x==256) return 1; return 0; }'
+assert 2 'int main() { int x; x=300; if (x<=299) return 1; else return 2; }'
+assert 7 'int main() { int *p; int a[2]; p=a; if (p<a+1) return 7; return 3; }'
+assert 2 'int main() { for (;0;) return 1; if (1) return 2; return 3; }'
+
+assert 18 'int main() { int a[20]; int b[20]; int i; for (i=0; i<20; i=i+1) b[i]=i; for (i=0; i<19; i=i+1) a[i]=b[i]; return a[18]; }'
+assert 66 'int main() { int a[23]; int b[23]; int c[23]; int i; int n; n=23; for (i=0; i<n; i=i+1) { b[i]=i; c[i]=i*2; } for (i=0; i<n; i=i+1) a[i]=b[i]+c[i]; return a[22]; }'
+assert 72 'int main() { char a[37]; char b[37]; char c[37]; int i; for (i=0; i<37; i=i+1) { b[i]=i*3; c[i]=i; } for (i=0; i<37; i=i+1) a[i]=b[i]-c[i]; return a[36]; }'
+assert 210 'int main() { int b[21]; int s; int i; for (i=0; i<21; i=i+1) b[i]=i; s=0; for (i=0; i<=20; i=i+1) s=s+b[i]; return s; }'
+assert 7 'int main() { int a[10]; int *p; int i; for (i=0; i<10; i=i+1) a[i]=i; a[0]=7; p=a+1; for (i=0; i<9; i=i+1) p[i]=a[i]; return a[9]; }'
+
+assert 7 'int main() { int x; x=-7; return x/2 + 10; }' -fno-sccp
+assert 3 'int main() { int x; x=-7; return x/-2; }' -fno-sccp
+assert 6 'int main() { int x; x=-100; return x/7 + 20; }' -fno-sccp
+assert 33 'int main() { int x; x=1000; return x/30; }' -fno-sccp
+assert 7 'int main() { int x; x=-2147483647-1; return (x/2==-1073741824) + (x/7==-306783378)*2 + (x/(-2147483647-1)==1)*4; }' -fno-sccp
+assert 6 'int main() { int x; int y; x=-9; y=2; return x/y + 10; }' -fno-sccp
+echo 'int main() { int x; x=-100; return x/7 + 20; }' | ./9cc -fno-sccp - | grep -q 'imul' || error 'division by constant'
+
+assert 126 'int g; int a[20]; int main() { char *p; char *q; p="abc"; q="abc"; a[3]=4; return (p==q) + "xyz"[1] + a[3] + g; }'
+assert 99 'char s[3]; int main() { char *p; p="abc"; s[2]=p[2]; return s[2]; }'
+
+assert 3 'int main() { ; return 3; }'
+assert_errors 3 'int main() { int x; x = 1 +; y = 2; if (x) { x = ; } return x; }'
+assert_errors 2 'int f( { return 1; } int main() { return 1 }'
+
+assert 13 '#include "tmp.h"
+#include "tmp.h"
+int main() { return SQ(2) + SQ(three()); }'
+assert 7 '#define N 5
+#define ADD(a, b) (a + b)
+#if N > 3 && defined(ADD)
+int main() { return ADD(N, 2); }
+#else
+int main() { return 1; }
+#endif'
+assert 2 '// comment
+#ifdef Y
+#elif 0
+#else
+int main() { int integer; integer = 1; /* integer */
+#define integer integer + 1
+return integer; }
+#endif'
+
+echo 'int g[4]; int sq(int x) { return x*x; } char *s() { return "ab"; }' | ./9cc --emit-ast=tmp.ast -
+assert 15 'int main() { char *p; char *q; g[1] = sq(3); p = s(); q = "xy"; return g[1] + p[1] + sq(2) + q[1] - 217; }' --load-ast=tmp.ast
+
+assert 38 '#define SUM(a, b, c) (a + b + c)
+int f(int x, int y) { return x * y; }
+int main() { int i; int s; s = 0;
+#if 1
+#if 0
+#if 1
+s = 100;
+#endif
+#endif
+  for (i = 0; i < 3; i = i + 1) s = s + SUM(f(i, 2) + f(1, 1),
+      f(2, 3) - 1 + f(i, i),
+      (1 + 2) * 1);
+#endif
+  return s; }'
+
+assert 22 'int sq(int x) { return x*x; } int a[8]; int main() { int i; char *p; for (i = 0; i < 8; i = i + 1) a[i] = i; p = "xyz"; return sq(a[3]) + a[7] + p[1] - 115; } int g;' --stream
+
+# Profile-guided build: instrument, run, then lay out with the profile.
+pgo='int f(int x) { if (x == 99) return 1; return 2; } int never() { return 3; }
+int main() { int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) { if (i < 0) s = never(); s = s + f(i); } return s - 150; }'
+rm -f tmp.prof
+echo "$pgo" | ./9cc -fprofile-generate - > tmp.s || error "$pgo"
+cc -static -o tmp tmp.s runtime/profile.c && NINECC_PROFILE=tmp.prof ./tmp
+assert 49 "$pgo" -fprofile-use=tmp.prof
+grep -q '^\.Lcold' tmp.s || error "$pgo"
+
+# Instrumented build: entry and exit hooks feed runtime/instrument.c.
+instr='int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(10); }'
+echo "$instr" | ./9cc -finstrument-functions - > tmp.s || error "$instr"
+cc -static -o tmp tmp.s runtime/instrument.c && NINECC_INSTRUMENT=tmp ./tmp
+[ "$?" = 55 ] && grep -q ' 177 .* fib$' tmp.flat && grep -q '^main;fib;fib ' tmp.folded || error "$instr"
+
+# Pass manager: -O levels, per-pass switches, dumps and statistics.
+passes='int sq(int x) { return x*x; } int a[16]; int main() { int i; int n; int s; n = 8; s = 0; for (i = 0; i < 16; i = i + 1) a[i] = i; for (i = 0; i < n * 2; i = i + 1) s = s + a[i]; return sq(s) - 14300; }'
+assert 100 "$passes" -O0
+assert 100 "$passes" -O1 -fvectorize -fno-licm
+echo "$passes" | ./9cc -ftime-report --print-after=inline - 2>&1 >/dev/null | grep -q '^vectorize  *1  *1 ' || error "$passes"
+echo "$passes" | ./9cc --print-after=inline - 2>&1 >/dev/null | grep -q 'inline sq {' || error "$passes"
+
+# Scalars whose address is not taken live in registers.
+assert 42 'int plus(int x, int y) { return x + y; } int main() { int a; int b; int c; int d; int e; int f; int g; int h; int i; a = 1; b = 2; c = 3; d = 4; e = 5; f = 6; g = 7; h = 8; for (i = 0; i < 3; i = i + 1) a = plus(a, i); return a + b + c + d + e + f + g + h + i; }'
+assert 98 'int main() { char c; char *p; int n; int *q; p = "abc"; c = p[1]; q = &n; *q = 0; return c + n; }'
+assert 200 'int f(char c) { char d; d = c; return d + 100; } int main() { return f(100); }'
+echo 'int add(int x, int y) { return x + y; }' | ./9cc - | sed -n '/^add:/,/ret/p' | grep -q '\[' && error 'add in registers'
+
+# Calls: arguments beyond the sixth go on the stack, and rsp is aligned.
+assert 204 'int main() { int x; x = 8; return add8(1, 2, 3, 4, 5, 6, 7, x); }'
+assert 104 'int sum8(int a, int b, int c, int d, int e, int f, int g, int h) { return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7 + h * 8; } int id(int x) { return x; } int main() { int x; int a[3]; x = 1; a[1] = 2; return sum8(x, a[1], id(3), 4, id(5), 6, id(7), x + 7) - 100; }' -fno-inline
+assert 5 'int main() { return stack_aligned() + (1 + stack_aligned()) + (1 + (1 + stack_aligned())) - 1; }'
+assert 3 'int main() { return add8(1, 1, 1, 1, 1, 1, 1, stack_aligned()) - 33; }'
+
+# switch: jump table, binary search and compare chain; fallthrough and break.
+assert 31 'int dense(int x) { switch (x) { case 0: return 10; case 1: return 11; case 2: return 12; case 3: case 4: return 34; case 6: return 16; default: return 99; } return 0; }
+int sparse(int x) { int r; r = 0; switch (x) { case -100: r = 1; break; case 7: r = 2; break; case 1000: r = 3; break; case 5000: r = 4; break; case 77777: r = 5; break; case 3: r = 6; } return r; }
+int small(int x) { int r; r = 1; switch (x) { case 1: r = r + 1; case 2: r = r + 2; break; case 3: r = 9; } return r; }
+int main() { return dense(0) + dense(4) + dense(5) + dense(6) + dense(-1) + sparse(-100) + sparse(77777) + sparse(3) + sparse(8) + small(1) + small(2) + small(3) + small(4); }'
+assert 44 'int main() { int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) { if (i == 10) break; switch (i) { case 3: break; case 5: case 1 + 1 * 6: s = s + 1; default: s = s + i; } } return s; }'
+assert 23 'int main() { int i; int s; char *p; p = "abc"; s = 0; i = 0; while (1) { switch (p[i]) { case 97: switch (i) { case 0: s = s + 10; break; } s = s + 1; break; case 98: s = s + 2; break; default: s = s + 100; } i = i + 1; if (i == 2) break; } return s + 10; }'
+echo 'int main() { switch (1) { case 0: case 1: case 2: case 3: return 1; } return 0; }' | ./9cc - | grep -q '^\.Ltable' || error 'switch jump table'
+
+# memory operands
+assert 2 'int g[8]; int *gp; int main() { int x[10]; int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) x[i] = i; for (i = 0; i < 10; i = i + 1) s = s + x[i]; g[3] = s; gp = g; return gp[3] + x[2] - g[3]; }'
+assert 38 'int g[4]; int at(int *p, int i, int j) { return p[i + j] + p[i] * p[j]; } int main() { int i; for (i = 0; i < 4; i = i + 1) g[i] = i + 1; return at(g, 1, 2) + g[i - 1] * 7; }'
+assert 9 'char s[4]; int main() { char t[3]; char i; int *p; int a[3]; i = 1; s[i] = 4; t[i + 1] = 5; a[2] = 9; p = a + 3; return s[1] + t[2] + p[-1] - 9; }'
+assert 7 'int get(int *p, int i) { return p[i]; } int main() { int a[4]; a[1] = 7; return get(a + 2, 0 - 1); }' -fno-inline
+echo 'int f(int i) { int x[4]; x[i] = 3; return x[i]; }' | ./9cc - | grep -q 'mov eax, DWORD PTR \[rbp+r[a-z0-9]*\*4-[0-9]*\]' || error 'indexed load'
+
+# immediate operands
+assert 191 'int main() { int x; int *p; int a[4]; x = 7; a[3] = 5; p = a; return (2 + x) * (3 * x) - (10 - x) + (1 == x - 6) + *(p + 3) + (0 != p) + -2 * x / 7; }'
+echo 'int main() { int i; for (i = 0; i < 10; i = i + 1) 0; return 2 * i; }' | ./9cc - | grep -q 'cmp eax, 10' || error 'immediate compare'
+
+# common subexpressions
+assert 64 'int f(int *x, int *y, int i, int j) { int a; int b; a = x[i + j] * 3 + (i * j + 1); b = x[i + j] - (i * j + 1); if (a < b) a = x[i + j]; y[i] = i * j + 1; b = b + x[i + j]; return a + b + (i * j + 1); }
+int main() { int x[8]; int y[8]; int i; for (i = 0; i < 8; i = i + 1) x[i] = i * 2; return f(x, y, 2, 3) + y[2]; }'
+assert 82 'int g; int bump(int *p) { *p = *p + 10; return 0; } int main() { int x; int *p; int s; x = 1; p = &x; g = 2; s = *p * g + 1; bump(p); s = s + (*p * g + 1); g = 5; s = s + (*p * g + 1); return s; }'
+assert 24 'int main() { int i; int s; int a[4]; a[0] = 1; a[1] = 2; a[2] = 3; a[3] = 4; i = 1; s = a[i] * 2 + a[i]; while (i < 4) { s = s + a[i] * 2; a[i] = 0; i = i + 1; } switch (s) { case 24: s = s + a[i - 3] * 2; case 25: s = s + a[i - 3] * 2; } return s + a[1]; }'
+echo 'int f(int *x, int i, int j) { return x[i + j] * (i * j + 1) + x[i + j] - (i * j + 1); }' | ./9cc -fopt-info - 2>&1 >/dev/null | grep -q 'f: reused 2 common subexpressions' || error 'cse'
+
+# constant propagation
+assert 172 'int a[16];
+int sum(int *p, int m) { int n; int i; int s; int k; int d; n = 16; d = 0; s = 0; k = n; if (n < 10) d = 1; else d = 2; for (i = 0; i < k; i = i + 1) s = s + p[i] * d; while (d == 3) s = 0; return s + m * (n / 4); }
+int main() { int i; int c; char ch; ch = 300; c = 5; for (i = 0; i < 16; i = i + 1) a[i] = i; switch (c) { case 5: c = c + 1; case 6: c = c * 2; break; default: c = 0; } return sum(a, ch) + c; }'
+assert 42 'int get(int **pp, int *a, int i) { return *(*(pp + a[i]) + (a[i] + 1)); } int main() { int *rows[2]; int idx[4]; int r1[4]; idx[2] = 1; rows[1] = r1; r1[2] = 42; return get(rows, idx, 2); }' -O1
+assert 42 'int ga[8]; int f(int k) { int i0; int lb[8]; lb[3] = 1; i0 = 100 + lb[k * 2 + 1]; return ga[k * 2 + 1]; } int main() { ga[3] = 42; return f(1); }'
+assert 109 'int main() { int i; int j; int n; int s; char c; n = 10; s = 0; for (i = 0; i < n; i = i + 1) { j = i; if (j == 7) break; s = s + j; } j = n; while (s < 100) s = s + j; c = 200; if (c < 0) s = s + 1; return s + i; }'
+echo 'int f(int x) { int n; n = 3; if (n < 2) return x; return n * x; }' | ./9cc --print-after=sccp - 2>&1 >/dev/null | grep -q 'return (3 \* x);' || error 'sccp'
+
 assert 34 'tests/fibonacci'
 echo OK
\ No newline at end of file
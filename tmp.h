@@ -0,0 +1,5 @@
+#ifndef TMP_H
+#define TMP_H
+#define SQ(x) ((x) * (x))
+int three() { return 3; }
+#endif
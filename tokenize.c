@@ -1,9 +1,5 @@
 #include "9cc.h"
 
-// Filename
-char *filename;
-// Input
-static char *user_input;
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *msg);
@@ -14,7 +10,6 @@ int expect_number(Token **tok);
 bool is_al(char character);
 bool is_alnum(char character);
 bool at_eof(Token **tok);
-static Token *new_token(TokenKind kind, Token *cur, char *loc, char *str, int len);
 static bool startswith(char *p, char *q);
 
 // Reports an error and exit.
@@ -27,57 +22,150 @@ void error(char *fmt, ...)
   exit(1);
 }
 
-// Reports an error location and exit.
-static void verror_at(char *loc, char *fmt, va_list ap)
+// The file being tokenized.
+static File *current_file;
+
+// Records the start of every line of `file`, once per file.
+static void index_lines(File *file)
 {
-  int pos = loc - user_input;
-  fprintf(stderr, "%s\n", user_input);
-  fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+  int cap = 64;
+  file->line_starts = malloc(sizeof(char *) * cap);
+  file->line_count = 0;
+  file->line_starts[file->line_count++] = file->contents;
+
+  for (char *p = file->contents; *p; p++)
+  {
+    if (*p != '\n')
+      continue;
+    if (file->line_count == cap)
+    {
+      cap *= 2;
+      file->line_starts = realloc(file->line_starts, sizeof(char *) * cap);
+    }
+    file->line_starts[file->line_count++] = p + 1;
+  }
+}
+
+// Returns the 0-based index of the line of `file` containing `loc`.
+static int find_line(File *file, char *loc)
+{
+  int lo = 0, hi = file->line_count - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (file->line_starts[mid] <= loc)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
 }
 
+// Syntax errors reported so far.
+int error_count;
+// Where the parser resumes after a syntax error, or NULL to exit.
+jmp_buf *error_recover;
+
 // エラーの起きた場所を報告するための関数
 // 下のようなフォーマットでエラーメッセージを表示する
 //
 // foo.c:10: x = y + + 5;
 //                   ^ 式ではありません
-void error_at(char *loc, char *msg)
+static void verror_at(File *file, char *loc, char *fmt, va_list ap)
 {
   // locが含まれている行の開始地点と終了地点を取得
-  char *line = loc;
-  while (user_input < line && line[-1] != '\n')
-    line--;
-
-  char *end = loc;
-  while (*end != '\n')
+  int line_num = find_line(file, loc);
+  char *line = file->line_starts[line_num];
+  char *end = line;
+  while (*end && *end != '\n')
     end++;
 
-  // 見つかった行が全体の何行目なのかを調べる
-  int line_num = 1;
-  for (char *p = user_input; p < line; p++)
-    if (*p == '\n')
-      line_num++;
-
   // 見つかった行を、ファイル名と行番号と一緒に表示
-  int indent = fprintf(stderr, "%s:%d: ", filename, line_num);
+  int indent = fprintf(stderr, "%s:%d: ", file->name, line_num + 1);
   fprintf(stderr, "%.*s\n", (int)(end - line), line);
 
   // エラー箇所を"^"で指し示して、エラーメッセージを表示
   int pos = loc - line + indent;
   fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-  fprintf(stderr, "^ %s\n", msg);
+  fprintf(stderr, "^ ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+
+  // Let the parser skip to the next statement unless we have reported
+  // enough already.
+  error_count++;
+  if (error_recover && error_count < opt_max_errors)
+    longjmp(*error_recover, 1);
   exit(1);
 }
 
-// Reports an error location and exit.
+static void error_loc(char *loc, char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  verror_at(current_file, loc, fmt, ap);
+}
+
+// Reports an error in the file being tokenized.
+void error_at(char *loc, char *msg)
+{
+  error_loc(loc, "%s", msg);
+}
+
+// Reports an error at a token.
 void error_tok(Token **tok, char *fmt, ...)
 {
   va_list ap;
   va_start(ap, fmt);
-  verror_at((*tok)->loc, fmt, ap);
+  verror_at((*tok)->file, (*tok)->loc, fmt, ap);
+}
+
+// The parser reads the main file through a window of token slots. Only the
+// current token and the LOOKAHEAD tokens after it are kept linked; older
+// slots are reused, so the window holds the same number of tokens however
+// long the input is. Token lists built in memory are walked as they are.
+#define LOOKAHEAD 2
+#define WINDOW 8
+
+static Token window[WINDOW];
+static int window_pos;
+static Token *(*token_source)(void);
+
+static Token *pull_token(void)
+{
+  // A half-made token cannot be skipped, so errors in the lexer and the
+  // preprocessor are fatal even while the parser is recovering.
+  jmp_buf *recover = error_recover;
+  error_recover = NULL;
+  Token *tok = &window[window_pos++ % WINDOW];
+  *tok = *token_source();
+  tok->next = NULL;
+  error_recover = recover;
+  return tok;
+}
+
+static void fill_lookahead(Token *tok)
+{
+  for (int i = 0; i < LOOKAHEAD && tok->kind != TK_EOF; i++, tok = tok->next)
+    if (!tok->next)
+      tok->next = pull_token();
+}
+
+// Returns the first token of a stream whose tokens are made on demand by
+// `source`, which must end it with TK_EOF.
+Token *token_stream(Token *(*source)(void))
+{
+  token_source = source;
+  Token *tok = pull_token();
+  fill_lookahead(tok);
+  return tok;
+}
+
+// Advances the cursor to the next token.
+void next_token(Token **tok)
+{
+  *tok = (*tok)->next;
+  fill_lookahead(*tok);
 }
 
 // Consumes the current token if it matches `op`.
@@ -85,7 +173,7 @@ bool consume(Token **tok, char *op)
 {
   if (equal(tok, op))
   {
-    *tok = (*tok)->next;
+    next_token(tok);
     return true;
   }
   return false;
@@ -97,7 +185,7 @@ bool equal(Token **tok, char *op)
   return memcmp((*tok)->str, op, (*tok)->len) == 0 && op[(*tok)->len] == '\0';
 }
 
-// Ensure that the x-next token is `op`.
+// Ensure that the x-next token is `op`. `x` must not exceed LOOKAHEAD.
 // ex. equal_xnext(tok, "==", 2)
 // => equal(&(tok->next->next), "==")
 bool equal_xnext(Token **tok, char *op, int x)
@@ -105,7 +193,7 @@ bool equal_xnext(Token **tok, char *op, int x)
   Token *cur = *tok;
   for (int i = 0; i < x; i++)
   {
-    if (cur->next == NULL)
+    if (i == LOOKAHEAD || cur->next == NULL)
       error_tok(tok, "equal_xnext: %dnext token is NULL", i);
     cur = cur->next;
   }
@@ -126,21 +214,17 @@ void expect(Token **tok, char *op)
   if ((*tok)->kind != TK_RESERVED ||
       (*tok)->len != strlen(op) ||
       memcmp((*tok)->str, op, (*tok)->len))
-  {
-    char *msg = calloc(1, 50);
-    sprintf(msg, "expected '%s' but got '%s'", op, (*tok)->str);
-    error_at((*tok)->loc, msg);
-  }
-  *tok = (*tok)->next;
+    error_tok(tok, "expected '%s' but got '%.*s'", op, (int)(*tok)->len, (*tok)->str);
+  next_token(tok);
 }
 
 // Ensure that the current token is TK_NUM.
 int expect_number(Token **tok)
 {
   if ((*tok)->kind != TK_NUM)
-    error_at((*tok)->loc, "expected a number");
+    error_tok(tok, "expected a number");
   int val = (*tok)->val;
-  *tok = (*tok)->next;
+  next_token(tok);
   return val;
 }
 
@@ -187,15 +271,79 @@ char *mystrndup(const char *s, size_t n)
   return t;
 }
 
-// Create a new token and add it as the next token of `cur`.
-static Token *new_token(TokenKind kind, Token *cur, char *loc, char *str, int len)
+// Spellings of identifiers are interned: a name is allocated once however
+// often it occurs, so lexing more tokens does not allocate more memory.
+static char **interned;
+static int interned_cap;
+static int ninterned;
+
+static unsigned hash_str(char *p, int len)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  return h;
+}
+
+static char *intern(char *p, int len)
+{
+  if (ninterned * 2 >= interned_cap)
+  {
+    char **old = interned;
+    int old_cap = interned_cap;
+    interned_cap = interned_cap ? interned_cap * 2 : 256;
+    interned = calloc(interned_cap, sizeof(char *));
+    for (int i = 0; i < old_cap; i++)
+    {
+      if (!old[i])
+        continue;
+      int j = hash_str(old[i], strlen(old[i])) & (interned_cap - 1);
+      while (interned[j])
+        j = (j + 1) & (interned_cap - 1);
+      interned[j] = old[i];
+    }
+    free(old);
+  }
+
+  int i = hash_str(p, len) & (interned_cap - 1);
+  for (; interned[i]; i = (i + 1) & (interned_cap - 1))
+    if (!strncmp(interned[i], p, len) && interned[i][len] == '\0')
+      return interned[i];
+  ninterned++;
+  return interned[i] = mystrndup(p, len);
+}
+
+// Lexer state of one file. Tokens are made on demand in a small ring of
+// slots, so a token returned by lex() stays valid only until LEX_RING more
+// tokens have been lexed; keep a copy to hold on to it longer.
+#define LEX_RING 8
+
+struct Lexer
 {
-  Token *tok = calloc(1, sizeof(Token));
+  File *file;
+  char *p;
+  bool at_bol;      // Flags for the next token created
+  bool has_space;
+  bool after_hash;  // The last token was `#` at the beginning of a line
+  bool header_name; // The next token may be the <file> of an #include
+  Token ring[LEX_RING];
+  int ring_pos;
+};
+
+// Create a new token in the next slot of the ring.
+static Token *new_token(Lexer *lx, TokenKind kind, char *loc, char *str, int len)
+{
+  Token *tok = &lx->ring[lx->ring_pos++ % LEX_RING];
+  *tok = (Token){};
   tok->kind = kind;
   tok->loc = loc;
   tok->str = str;
   tok->len = len;
-  cur->next = tok;
+  tok->file = lx->file;
+  tok->at_bol = lx->at_bol;
+  tok->has_space = lx->has_space;
+  lx->at_bol = lx->has_space = false;
+  lx->after_hash = is_hash(tok);
   return tok;
 }
 
@@ -204,140 +352,234 @@ static bool startswith(char *p, char *q)
   return memcmp(p, q, strlen(q)) == 0;
 }
 
-// Tokenize `user_input` and returns new tokens.
-Token *tokenize(char *filename, char *p)
+// Returns true if `p` starts with the keyword `kw` and not a longer
+// identifier such as `integer` or `ifdef`.
+static bool startswith_word(char *p, char *kw)
 {
-  filename = filename;
-  user_input = p;
-  Token head;
-  head.next = NULL;
-  Token *cur = &head;
+  int len = strlen(kw);
+  return strncmp(p, kw, len) == 0 && !is_alnum(p[len]);
+}
+
+// Returns true if `tok` is `#` at the beginning of a line, i.e. starts a
+// preprocessing directive.
+bool is_hash(Token *tok)
+{
+  return tok->at_bol && tok->kind == TK_RESERVED && tok->len == 1 && tok->str[0] == '#';
+}
+
+// Starts lexing the contents `p` of the file `path`.
+Lexer *new_lexer(char *path, char *p)
+{
+  File *file = calloc(1, sizeof(File));
+  file->name = path;
+  file->contents = p;
+  index_lines(file);
+
+  Lexer *lx = calloc(1, sizeof(Lexer));
+  lx->file = file;
+  lx->p = p;
+  lx->at_bol = true;
+  return lx;
+}
+
+// Returns the next token of `lx`. At the end of the file it keeps
+// returning TK_EOF.
+Token *lex(Lexer *lx)
+{
+  current_file = lx->file;
+  char *p = lx->p;
+
+  // `#include <file>`: the file name is one string token.
+  if (lx->header_name)
+  {
+    lx->header_name = false;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '<')
+    {
+      char *start = p++;
+      while (*p && *p != '>' && *p != '\n')
+        p++;
+      if (*p != '>')
+        error_at(start, "expected '>'");
+      lx->p = p + 1;
+      lx->has_space = true;
+      return new_token(lx, TK_STR, start, mystrndup(start + 1, p - start - 1), p - start - 1);
+    }
+  }
 
   while (*p)
   {
+    // Skip line comments.
+    if (startswith(p, "//"))
+    {
+      while (*p && *p != '\n')
+        p++;
+      lx->has_space = true;
+      continue;
+    }
+
+    // Skip block comments.
+    if (startswith(p, "/*"))
+    {
+      char *q = strstr(p + 2, "*/");
+      if (!q)
+        error_at(p, "unclosed block comment");
+      p = q + 2;
+      lx->has_space = true;
+      continue;
+    }
+
     // Skip whitespace characters.
     if (isspace(*p))
     {
+      if (*p == '\n')
+        lx->at_bol = true;
+      lx->has_space = true;
       p++;
       continue;
     }
 
     // Punctuator
     if (startswith(p, "==") || startswith(p, "!=") ||
-        startswith(p, "<=") || startswith(p, ">="))
+        startswith(p, "<=") || startswith(p, ">=") ||
+        startswith(p, "&&") || startswith(p, "||"))
     {
-      char *str = mystrndup(p, 2);
-      cur = new_token(TK_RESERVED, cur, p, str, 2);
-      p += 2;
-      continue;
+      lx->p = p + 2;
+      return new_token(lx, TK_RESERVED, p, intern(p, 2), 2);
     }
-    if (strchr("+-*/()<>;,={}&[]", *p))
+    if (strchr("+-*/()<>;,={}&[]!#:", *p))
     {
-      char *str = mystrndup(p, 1);
-      cur = new_token(TK_RESERVED, cur, p++, str, 1);
-      continue;
+      lx->p = p + 1;
+      return new_token(lx, TK_RESERVED, p, intern(p, 1), 1);
     }
 
     // String
     if (startswith(p, "\""))
     {
-      p++;
+      char *start = p++;
       int str_len = 0;
       while (!startswith(p, "\""))
       {
+        if (!*p || *p == '\n')
+          error_at(start, "unclosed string literal");
         if (str_len > 128)
           error_at(p, "String too long");
         str_len++;
         p++;
       }
 
-      char *str = mystrndup(p - str_len, str_len);
-      cur = new_token(TK_STR, cur, p, str, str_len);
-      p++;
-      continue;
+      lx->p = p + 1;
+      // Interned like identifiers: a literal repeated in every function of a
+      // streamed file is stored once.
+      return new_token(lx, TK_STR, start, intern(p - str_len, str_len), str_len);
     }
 
     // Integer literal
     if (isdigit(*p))
     {
-      cur = new_token(TK_NUM, cur, p, "", 0);
-      char *q = p;
-      cur->val = strtol(p, &p, 10);
-      cur->len = p - q;
-      continue;
+      Token *tok = new_token(lx, TK_NUM, p, "", 0);
+      tok->val = strtol(p, &lx->p, 10);
+      tok->len = lx->p - p;
+      return tok;
     }
 
-    if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6]))
+    if (startswith_word(p, "return"))
     {
-      cur = new_token(TK_KEYWORD, cur, p, "return ", 6);
-      p += 6;
-      continue;
+      lx->p = p + 6;
+      return new_token(lx, TK_KEYWORD, p, "return ", 6);
     }
-    if (strncmp(p, "else", 4) == 0)
+    if (startswith_word(p, "else"))
     {
-      cur = new_token(TK_KEYWORD, cur, p, "else", 4);
-      p += 4;
-      continue;
+      lx->p = p + 4;
+      return new_token(lx, TK_KEYWORD, p, "else", 4);
     }
-    if (strncmp(p, "for", 3) == 0)
+    if (startswith_word(p, "for"))
     {
-      cur = new_token(TK_KEYWORD, cur, p, "for", 3);
-      p += 3;
-      continue;
+      lx->p = p + 3;
+      return new_token(lx, TK_KEYWORD, p, "for", 3);
     }
-    if (strncmp(p, "while", 5) == 0)
+    if (startswith_word(p, "while"))
     {
-      cur = new_token(TK_KEYWORD, cur, p, "while", 5);
-      p += 5;
-      continue;
+      lx->p = p + 5;
+      return new_token(lx, TK_KEYWORD, p, "while", 5);
+    }
+    if (startswith_word(p, "switch"))
+    {
+      lx->p = p + 6;
+      return new_token(lx, TK_KEYWORD, p, "switch", 6);
+    }
+    if (startswith_word(p, "case"))
+    {
+      lx->p = p + 4;
+      return new_token(lx, TK_KEYWORD, p, "case", 4);
+    }
+    if (startswith_word(p, "default"))
+    {
+      lx->p = p + 7;
+      return new_token(lx, TK_KEYWORD, p, "default", 7);
+    }
+    if (startswith_word(p, "break"))
+    {
+      lx->p = p + 5;
+      return new_token(lx, TK_KEYWORD, p, "break", 5);
     }
 
-    if (strncmp(p, "if", 2) == 0)
+    if (startswith_word(p, "if"))
     {
-      cur = new_token(TK_KEYWORD, cur, p, "if", 2);
-      p += 2;
-      continue;
+      lx->p = p + 2;
+      return new_token(lx, TK_KEYWORD, p, "if", 2);
     }
 
-    if (strncmp(p, "int", 3) == 0)
+    if (startswith_word(p, "int"))
     {
-      cur = new_token(TK_TYPE, cur, p, "int", 3);
-      p += 3;
-      continue;
+      lx->p = p + 3;
+      return new_token(lx, TK_TYPE, p, "int", 3);
     }
 
-    if (strncmp(p, "char", 4) == 0)
+    if (startswith_word(p, "char"))
     {
-      cur = new_token(TK_TYPE, cur, p, "char", 4);
-      p += 4;
-      continue;
+      lx->p = p + 4;
+      return new_token(lx, TK_TYPE, p, "char", 4);
     }
 
-    if (strncmp(p, "sizeof", 6) == 0)
+    if (startswith_word(p, "sizeof"))
     {
-      cur = new_token(TY_SIZEOF, cur, p, "sizeof", 6);
-      p += 6;
-      continue;
+      lx->p = p + 6;
+      return new_token(lx, TY_SIZEOF, p, "sizeof", 6);
     }
 
     if (is_al(*p))
     {
       char *q = p;
-      char *var_str = calloc(128, sizeof(char));
-      int var_length = 0;
       while (is_alnum(*p))
-      {
-        var_str[var_length] = *p;
-        var_length++;
         p++;
-      }
-      var_str[var_length] = '\0';
-      cur = new_token(TK_IDENT, cur, q, var_str, var_length);
-      continue;
+      bool after_hash = lx->after_hash;
+      Token *tok = new_token(lx, TK_IDENT, q, intern(q, p - q), p - q);
+      lx->header_name = after_hash && equal(&tok, "include");
+      lx->p = p;
+      return tok;
     }
 
     error_at(p, "invalid token");
   }
-  new_token(TK_EOF, cur, p, "", 0);
+
+  lx->p = p;
+  lx->at_bol = true;
+  return new_token(lx, TK_EOF, p, "", 0);
+}
+
+// Tokenize the contents `p` of the file `path` and returns new tokens.
+Token *tokenize(char *path, char *p)
+{
+  Lexer *lx = new_lexer(path, p);
+  Token head = {};
+  Token *cur = &head;
+  do
+  {
+    cur = cur->next = calloc(1, sizeof(Token));
+    *cur = *lex(lx);
+  } while (cur->kind != TK_EOF);
+  free(lx);
   return head.next;
 }
@@ -1,7 +1,69 @@
 #include "9cc.h"
+#include <stdint.h>
 
 Type *ty_int = &(Type){INT, 4, 0};
-Type *ty_ptr = &(Type){PTR, 8, 0};
+
+// Types are interned: equal types are one object, so declarations and
+// expressions do not allocate a type each and memory stays bounded by the
+// number of distinct types, however many functions are streamed.
+static Type **types;
+static int types_cap;
+static int ntypes;
+
+static unsigned hash_type(TypeKeyword tkey, int size, Type *ptr_to)
+{
+    unsigned h = (unsigned)tkey * 31 + (unsigned)size;
+    return h * 2654435761u ^ (unsigned)((uintptr_t)ptr_to >> 4);
+}
+
+static Type **lookup_type(TypeKeyword tkey, int size, Type *ptr_to)
+{
+    int i = hash_type(tkey, size, ptr_to) & (types_cap - 1);
+    for (; types[i]; i = (i + 1) & (types_cap - 1))
+        if (types[i]->tkey == tkey && types[i]->size == size && types[i]->ptr_to == ptr_to)
+            break;
+    return &types[i];
+}
+
+Type *new_type(TypeKeyword tkey, int size, Type *ptr_to)
+{
+    if (ntypes * 2 >= types_cap)
+    {
+        Type **old = types;
+        int old_cap = types_cap;
+        types_cap = types_cap ? types_cap * 2 : 64;
+        types = calloc(types_cap, sizeof(Type *));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i])
+                *lookup_type(old[i]->tkey, old[i]->size, old[i]->ptr_to) = old[i];
+        free(old);
+        if (!ntypes)
+        {
+            *lookup_type(INT, 4, NULL) = ty_int;
+            ntypes++;
+        }
+    }
+
+    Type **slot = lookup_type(tkey, size, ptr_to);
+    if (*slot)
+        return *slot;
+    Type *ty = calloc(1, sizeof(Type));
+    ty->tkey = tkey;
+    ty->size = size;
+    ty->ptr_to = ptr_to;
+    ntypes++;
+    return *slot = ty;
+}
+
+Type *pointer_to(Type *base)
+{
+    return new_type(PTR, 8, base);
+}
+
+Type *array_of(Type *base, int len)
+{
+    return new_type(ARRAY, base->size * len, base);
+}
 
 void add_type(Node *node)
 {
@@ -10,18 +72,40 @@ void add_type(Node *node)
 
     // printf("add_type: %d\n", node->kind);
 
-    add_type(node->next);
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
-    for (int i = 0; i < (node->block_count); i++)
-        add_type(node->block[i]);
-    for (Node *arg = node->args; arg; arg = arg->next)
-        add_type(arg);
+    switch (node->kind)
+    {
+    case ND_IF:
+    case ND_IFELSE:
+    case ND_ELSE:
+    case ND_SWITCH:
+    case ND_CASE:
+    case ND_WHILE:
+    case ND_FOR:
+        add_type(node->cond);
+        add_type(node->then);
+        add_type(node->els);
+        add_type(node->init);
+        add_type(node->inc);
+        break;
+    case ND_BLOCK:
+    case ND_INLINE:
+        for (int i = 0; i < (node->block_count); i++)
+            add_type(node->block[i]);
+        break;
+    case ND_FUNCALL:
+        for (Node *arg = node->args; arg; arg = arg->next)
+            add_type(arg);
+        break;
+    case ND_NUM:
+    case ND_VAR:
+    case ND_VECLOOP:
+    case ND_NONE:
+    case ND_BREAK:
+        break;
+    default:
+        add_type(node->lhs);
+        add_type(node->rhs);
+    }
 
     switch (node->kind)
     {
@@ -48,19 +132,23 @@ void add_type(Node *node)
     case ND_IF:
     case ND_IFELSE:
     case ND_ELSE:
+    case ND_SWITCH:
+    case ND_CASE:
     case ND_WHILE:
     case ND_FOR:
     case ND_BLOCK:
+    case ND_VECLOOP:
     case ND_NONE:
+    case ND_BREAK:
         return;
     case ND_FUNCALL:
+    case ND_INLINE:
         node->ty = ty_int;
         return;
     case ND_ADDR:
-        node->ty = ty_ptr;
         if (!node->lhs->ty)
             error("ND_ADDR: invalid pointer address");
-        node->ty->ptr_to = node->lhs->ty;
+        node->ty = pointer_to(node->lhs->ty);
         return;
     case ND_DEREF:
         if (!node->lhs->ty->ptr_to)
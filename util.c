@@ -56,4 +56,63 @@ char *read_file(char *path)
     }
 
     return content;
-}
\ No newline at end of file
+}
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+static ArenaChunk *arena;
+
+// Bump allocator for AST nodes and their child arrays.
+// Returned memory is zero-filled and 8-byte aligned; it is never freed
+// individually.
+void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    if (!arena || arena->used + size > arena->cap)
+    {
+        size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *chunk = calloc(1, sizeof(ArenaChunk) + cap);
+        if (!chunk)
+            error("Memory allocation error");
+        chunk->cap = cap;
+        chunk->next = arena;
+        arena = chunk;
+    }
+
+    void *p = arena->data + arena->used;
+    arena->used += size;
+    return p;
+}
+
+ArenaMark arena_mark(void)
+{
+    return (ArenaMark){arena, arena ? arena->used : 0};
+}
+
+// Frees everything allocated since `mark`. Nodes allocated after it must no
+// longer be referenced.
+void arena_release(ArenaMark mark)
+{
+    while (arena && arena != mark.chunk)
+    {
+        ArenaChunk *chunk = arena;
+        arena = chunk->next;
+        free(chunk);
+    }
+    if (!arena)
+        return;
+
+    // Memory handed out again must be zero-filled.
+    memset(arena->data + mark.used, 0, arena->used - mark.used);
+    arena->used = mark.used;
+}
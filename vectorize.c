@@ -0,0 +1,299 @@
+#include "9cc.h"
+
+// Loop vectorization.
+//
+// Recognizes counted loops over int or char arrays of the forms
+//
+//   for (...; i < n; i = i + 1) a[i] = b[i];
+//   for (...; i < n; i = i + 1) a[i] = b[i] + c[i];   (or -)
+//   for (...; i < n; i = i + 1) s = s + b[i];         (int only)
+//
+// and puts an ND_VECLOOP in front of the loop. The vector loop advances `i`
+// one SSE2 (or AVX2 with -mavx2) register of elements at a time; the
+// original loop, with its initializer moved in front of both, then runs the
+// remaining iterations.
+
+static Obj *current_fn;
+static int nvectorized;
+
+static char reason[128]; // Why the last loop was rejected
+
+static bool reject(char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(reason, sizeof(reason), fmt, ap);
+  va_end(ap);
+  return false;
+}
+
+static bool is_var(Node *node, Obj *var)
+{
+  return node->kind == ND_VAR && node->var == var;
+}
+
+static bool is_num(Node *node, int val)
+{
+  return node->kind == ND_NUM && node->val == val;
+}
+
+// Matches `base[i]`, i.e. *(base + i * sizeof(elem)), with an int or char
+// element, and returns `base`.
+static Node *match_elem(Node *node, Obj *i)
+{
+  if (node->kind != ND_DEREF || (node->ty->tkey != INT && node->ty->tkey != CHAR))
+    return NULL;
+
+  Node *add = node->lhs;
+  if (add->kind != ND_ADD)
+    return NULL;
+
+  Node *mul = add->rhs;
+  if (mul->kind != ND_MUL || !is_var(mul->lhs, i) || !is_num(mul->rhs, node->ty->size))
+    return NULL;
+
+  // The base must not change while the loop stores to memory.
+  Node *base = add->lhs;
+  if (base->kind != ND_VAR)
+    return NULL;
+  if (base->var->ty->tkey == ARRAY)
+    return base;
+  if (base->var->ty->tkey == PTR && !base->var->addr_taken)
+    return base;
+  return NULL;
+}
+
+// A store to `dst[i]` must not change what a later iteration reads from
+// `src[i + k]`. That holds if both are the same variable, or if both are
+// distinct arrays. A pointer may point anywhere into another array.
+static bool may_alias(Node *dst, Node *src)
+{
+  if (dst->var == src->var)
+    return false;
+  return dst->var->ty->tkey != ARRAY || src->var->ty->tkey != ARRAY;
+}
+
+static bool analyze(Node *loop, VecLoop *vec)
+{
+  // i = i + 1
+  Node *inc = loop->inc;
+  if (!inc || inc->kind != ND_ASSIGN || inc->lhs->kind != ND_VAR)
+    return reject("no unit-stride induction variable");
+  Obj *i = inc->lhs->var;
+  Node *step = inc->rhs;
+  if (step->kind != ND_ADD ||
+      !((is_var(step->lhs, i) && is_num(step->rhs, 1)) ||
+        (is_num(step->lhs, 1) && is_var(step->rhs, i))))
+    return reject("no unit-stride induction variable");
+  if (!i->is_local || i->addr_taken || i->ty->tkey != INT)
+    return reject("induction variable %s is not an unaliased local int", i->name);
+
+  // i < end, i <= end
+  Node *cond = loop->cond;
+  if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE) || !is_var(cond->lhs, i))
+    return reject("condition is not of the form `i < n` or `i <= n`");
+  Node *end = cond->rhs;
+  if (end->kind != ND_NUM &&
+      !(end->kind == ND_VAR && end->var != i && end->var->ty->tkey == INT &&
+        end->var->is_local && !end->var->addr_taken))
+    return reject("bound is not a constant or an unaliased local int");
+
+  Node *body = loop->then;
+  if (body->kind == ND_BLOCK && body->block_count == 1)
+    body = body->block[0];
+  if (body->kind != ND_ASSIGN)
+    return reject("body is not a single assignment");
+
+  Node *lhs = body->lhs;
+  Node *rhs = body->rhs;
+  vec->index = i;
+  vec->end = end;
+  vec->inclusive = cond->kind == ND_LE;
+
+  // s = s + b[i]
+  if (lhs->kind == ND_VAR)
+  {
+    Obj *acc = lhs->var;
+    if (acc == i || is_var(end, acc) || acc->ty->tkey != INT || !acc->is_local || acc->addr_taken)
+      return reject("reduction variable is not an unaliased local int");
+    if (rhs->kind != ND_ADD)
+      return reject("reduction is not a sum");
+
+    Node *elem;
+    if (is_var(rhs->lhs, acc))
+      elem = rhs->rhs;
+    else if (is_var(rhs->rhs, acc))
+      elem = rhs->lhs;
+    else
+      return reject("reduction is not a sum");
+
+    Node *src = match_elem(elem, i);
+    if (!src)
+      return reject("reduction operand is not an array element indexed by %s", i->name);
+    if (elem->ty->tkey != INT)
+      return reject("only int reductions are supported");
+
+    vec->op = VEC_SUM;
+    vec->elem_size = 4;
+    vec->src1 = src;
+    vec->acc = acc;
+    return true;
+  }
+
+  // a[i] = ...
+  Node *dst = match_elem(lhs, i);
+  if (!dst)
+    return reject("store is not to an array element indexed by %s", i->name);
+  vec->dst = dst;
+  vec->elem_size = lhs->ty->size;
+
+  Node *src1 = NULL, *src2 = NULL;
+  Node *elem1 = NULL, *elem2 = NULL;
+  switch (rhs->kind)
+  {
+  case ND_DEREF:
+    vec->op = VEC_COPY;
+    elem1 = rhs;
+    break;
+  case ND_ADD:
+  case ND_SUB:
+    vec->op = rhs->kind == ND_ADD ? VEC_ADD : VEC_SUB;
+    elem1 = rhs->lhs;
+    elem2 = rhs->rhs;
+    break;
+  default:
+    return reject("stored value is not a copy, sum or difference of array elements");
+  }
+
+  src1 = match_elem(elem1, i);
+  if (elem2)
+    src2 = match_elem(elem2, i);
+  if (!src1 || (elem2 && !src2))
+    return reject("operand is not an array element indexed by %s", i->name);
+  if (elem1->ty->size != vec->elem_size || (elem2 && elem2->ty->size != vec->elem_size))
+    return reject("mixed element types");
+
+  if (may_alias(dst, src1))
+    return reject("%s may alias %s", dst->var->name, src1->var->name);
+  if (src2 && may_alias(dst, src2))
+    return reject("%s may alias %s", dst->var->name, src2->var->name);
+
+  vec->src1 = src1;
+  vec->src2 = src2;
+  return true;
+}
+
+static char *op_name(VecOp op)
+{
+  switch (op)
+  {
+  case VEC_COPY:
+    return "copy";
+  case VEC_ADD:
+    return "add";
+  case VEC_SUB:
+    return "sub";
+  case VEC_SUM:
+    return "sum";
+  }
+  return "";
+}
+
+static void vectorize_loop(Node **slot)
+{
+  Node *loop = *slot;
+  VecLoop info = {};
+
+  if (!analyze(loop, &info))
+  {
+    if (opt_info)
+      fprintf(stderr, "%s: loop not vectorized: %s\n", current_fn->name, reason);
+    return;
+  }
+
+  // Lives as long as the loop's nodes, so it is freed with the function
+  // when streaming.
+  VecLoop *vec = arena_alloc(sizeof(VecLoop));
+  *vec = info;
+
+  if (opt_info)
+  {
+    int width = (opt_avx2 ? 32 : 16) / vec->elem_size;
+    fprintf(stderr, "%s: loop over %s vectorized (%s, %d x %s)\n", current_fn->name,
+            vec->index->name, op_name(vec->op), width, vec->elem_size == 1 ? "char" : "int");
+  }
+
+  Node *node = new_node(ND_VECLOOP);
+  node->vec = vec;
+
+  Node *block = new_node(ND_BLOCK);
+  block->block = arena_alloc(sizeof(Node *) * 3);
+  if (loop->init)
+  {
+    block->block[block->block_count++] = loop->init;
+    loop->init = NULL;
+  }
+  block->block[block->block_count++] = node;
+  block->block[block->block_count++] = loop;
+  *slot = block;
+  nvectorized++;
+}
+
+static void visit(Node **slot)
+{
+  Node *node = *slot;
+  if (!node)
+    return;
+
+  switch (node->kind)
+  {
+  case ND_IF:
+  case ND_IFELSE:
+  case ND_ELSE:
+  case ND_SWITCH:
+  case ND_CASE:
+  case ND_WHILE:
+    visit(&node->then);
+    visit(&node->els);
+    return;
+  case ND_FOR:
+    visit(&node->then);
+    vectorize_loop(slot);
+    return;
+  case ND_BLOCK:
+  case ND_INLINE:
+    for (int i = 0; i < node->block_count; i++)
+      visit(&node->block[i]);
+    return;
+  case ND_FUNCALL:
+    for (Node *arg = node->args; arg; arg = arg->next)
+      visit(&arg);
+    return;
+  case ND_NUM:
+  case ND_VAR:
+  case ND_VECLOOP:
+  case ND_NONE:
+  case ND_BREAK:
+  case ND_SIZEOF:
+    return;
+  default:
+    visit(&node->lhs);
+    visit(&node->rhs);
+  }
+}
+
+// Vectorizes simple counted loops. Returns the number of loops vectorized.
+int vectorize_loops(Obj *prog)
+{
+  nvectorized = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+  {
+    if (!fn->is_function)
+      continue;
+    current_fn = fn;
+    analyze_lvars(fn);
+    for (int i = 0; i < fn->stmt_count; i++)
+      visit(&fn->body[i]);
+  }
+  return nvectorized;
+}